@@ -0,0 +1,457 @@
+// Template, UU version
+// IGAD/NHTV/UU - Jacco Bikker - 2006-2018
+
+#include "precomp.h"
+
+namespace Tmpl8 {
+
+static volatile uint sink; // keeps benchmark loops from being optimized away
+
+// -----------------------------------------------------------
+// CacheModel
+// set-associative LRU cache model, 32KB with 64-byte lines
+// and 8 ways, like a typical L1 data cache
+// -----------------------------------------------------------
+struct CacheModel
+{
+	enum { SETS = 64, WAYS = 8 };
+	CacheModel() { memset( tag, 255, sizeof( tag ) ), memset( age, 0, sizeof( age ) ), stamp = accesses = misses = 0; }
+	void Access( const void* p )
+	{
+		const uint64 line = (uint64)p >> 6;
+		uint64* t = tag[line & (SETS - 1)];
+		uint* a = age[line & (SETS - 1)];
+		int oldest = 0;
+		accesses++;
+		for( int w = 0; w < WAYS; w++ )
+		{
+			if (t[w] == line) { a[w] = ++stamp; return; }
+			if (a[w] < a[oldest]) oldest = w;
+		}
+		t[oldest] = line, a[oldest] = ++stamp, misses++;
+	}
+	float MissRate() { return accesses ? (100.0f * misses) / accesses : 0; }
+	uint64 tag[SETS][WAYS];
+	uint age[SETS][WAYS], stamp;
+	uint64 accesses, misses;
+};
+
+// -----------------------------------------------------------
+// SampleSpans
+// samples texels along spans at the given angle in texture
+// space, as the span loop of the rasterizer does; feeds the
+// texel addresses to a cache model if one is supplied,
+// returns the time spent otherwise.
+// -----------------------------------------------------------
+static const int spans = 20000, spanLength = 128;
+static float SampleSpans( Surface8& texture, int angle, CacheModel* cache )
+{
+	const float du = cosf( angle * PI / 180 ), dv = sinf( angle * PI / 180 );
+	const unsigned char* src = texture.GetBuffer();
+	const Pixel* pal = texture.GetPalette( PALETTE_BASE );
+	const int size = texture.GetWidth(), shift = texture.GetWidthShift(), mask = size - 1, layout = texture.GetLevelLayout( 0 );
+	const unsigned char* sub = (layout == Surface8::BLOCK4) ? texture.GetSubPalettes( 0 ) : 0;
+	uint sum = 0;
+	srand( angle );
+	timer t;
+	for( int s = 0; s < spans; s++ )
+	{
+		float u = Rand( (float)size ), v = Rand( (float)size );
+		for( int i = 0; i < spanLength; i++, u += du, v += dv )
+		{
+			const int iu = (int)u & mask, iv = (int)v & mask;
+			const int addr = (layout == Surface8::LINEAR) ? (iu + (iv << shift)) : Surface8::TiledAddress( iu, iv, shift );
+			if (cache)
+			{
+				if (layout != Surface8::BLOCK4) cache->Access( src + addr );
+				else cache->Access( src + (addr >> 1) ), cache->Access( sub + ((addr >> 6) << 4) );
+			}
+			else if (layout != Surface8::BLOCK4) sum += pal[src[addr]];
+			else sum += pal[Surface8::Block4Index( src, sub, addr )];
+		}
+	}
+	sink = sum;
+	return t.elapsed();
+}
+
+// -----------------------------------------------------------
+// BenchmarkTracer
+// the raytracer the BVH benchmarks share: the scene, an
+// offscreen target, and the BVH (binned SAH) and 8-wide BVH,
+// built once
+// -----------------------------------------------------------
+static Raytracer* BenchmarkTracer( Scene* scene )
+{
+	Raytracer* raytracer = new Raytracer();
+	raytracer->scene = scene, raytracer->screen = new Surface( SCRWIDTH, SCRHEIGHT );
+	raytracer->bvh.Build( scene );
+	raytracer->bvh8.Build( raytracer->bvh );
+	return raytracer;
+}
+
+// -----------------------------------------------------------
+// RunBenchmarks
+// -----------------------------------------------------------
+void RunBenchmarks( Scene* scene, const char* file )
+{
+	BenchmarkTexelLayout();
+	BenchmarkTextureFormat();
+	BenchmarkShading();
+	BenchmarkScaling();
+	BenchmarkDispatch();
+	Raytracer* raytracer = BenchmarkTracer( scene );
+	BenchmarkBVH( raytracer );
+	BenchmarkBVH8( raytracer );
+	BenchmarkPackets( raytracer );
+	delete raytracer->screen;
+	delete raytracer;
+	BenchmarkStreaming( scene, file );
+}
+
+// -----------------------------------------------------------
+// BenchmarkTexelLayout
+// samples spans at various angles in texture space through a
+// large texture, with the linear and the tiled texel layout;
+// reports the simulated L1 miss rate and the time per layout.
+// -----------------------------------------------------------
+void BenchmarkTexelLayout()
+{
+	const int size = 2048;
+	Surface8 texture( size, size );
+	printf( "texel layout: %ix%i texture, %i spans of %i texels\n", size, size, spans, spanLength );
+	for( int angle = 0; angle <= 90; angle += 15 )
+	{
+		float missRate[2], time[2];
+		for( int layout = Surface8::LINEAR; layout <= Surface8::TILED; layout++ )
+		{
+			CacheModel cache;
+			texture.SetLayout( layout );
+			SampleSpans( texture, angle, &cache );
+			time[layout] = SampleSpans( texture, angle, 0 );
+			missRate[layout] = cache.MissRate();
+		}
+		printf( "%2i deg: linear %5.1f%% misses, %6.2fms | tiled %5.1f%% misses, %6.2fms\n",
+			angle, missRate[0], time[0], missRate[1], time[1] );
+	}
+}
+
+// -----------------------------------------------------------
+// BenchmarkTextureFormat
+// compares the 8-bit tiled texel format against the 4-bit
+// block format: texture memory, simulated L1 miss rate and
+// span sampling time, summed over all span angles.
+// note: the synthetic texture has random texels, which is the
+// worst case for block format quality, but not for speed.
+// -----------------------------------------------------------
+void BenchmarkTextureFormat()
+{
+	const int size = 2048, layouts[2] = { Surface8::TILED, Surface8::BLOCK4 };
+	const char* name[2] = { "8-bit tiled", "4-bit block" };
+	Surface8 texture( size, size );
+	printf( "texture format: %ix%i texture, %i spans of %i texels per angle\n", size, size, spans, spanLength );
+	for( int i = 0; i < 2; i++ )
+	{
+		CacheModel cache;
+		float time = 0;
+		texture.SetLayout( layouts[i] );
+		for( int angle = 0; angle <= 90; angle += 15 ) SampleSpans( texture, angle, &cache ), time += SampleSpans( texture, angle, 0 );
+		printf( "%s: %7.1fKB, %5.1f%% misses, %7.2fms\n", name[i], texture.GetResidentBytes() / 1024.0f, cache.MissRate(), time );
+	}
+}
+
+// -----------------------------------------------------------
+// BenchmarkShading
+// fill rate of the palettized material path (flat shading via
+// pre-scaled palettes), nearest and bilinear, versus the truecolor
+// path (32-bit texels, per-vertex lighting with SIMD multiplies):
+// renders a textured quad that covers the screen in each mode.
+// -----------------------------------------------------------
+void BenchmarkShading()
+{
+	const int size = 1024, frames = 50;
+	const char* name[3] = { "palettized", "bilinear", "truecolor" };
+	const int format[3] = { Material::PALETTIZED, Material::PALETTIZED, Material::TRUECOLOR };
+	const int filter[3] = { Material::NEAREST, Material::BILINEAR, Material::NEAREST };
+	Surface8* pixels = new Surface8( size, size );
+	Surface* rgba = new Surface( size, size );
+	for( int i = 0; i < size * size; i++ ) rgba->GetBuffer()[i] = pixels->GetPalette( PALETTE_BASE )[pixels->GetBuffer()[i]];
+	Texture texture;
+	texture.pixels = pixels, texture.BuildTruecolor( rgba );
+	Material material;
+	material.texture = &texture;
+	Mesh quad( 4, 2 );
+	const float x = 0.6f, y = 0.4f;
+	const int tri[6] = { 0, 1, 2, 0, 2, 3 };
+	quad.pos[0] = vec3( -x, -y, -1 ), quad.pos[1] = vec3( x, -y, -1 ), quad.pos[2] = vec3( x, y, -1 ), quad.pos[3] = vec3( -x, y, -1 );
+	quad.uv[0] = vec2( 0, 0 ), quad.uv[1] = vec2( 1, 0 ), quad.uv[2] = vec2( 1, 1 ), quad.uv[3] = vec2( 0, 1 );
+	for( int i = 0; i < 4; i++ ) quad.norm[i] = normalize( vec3( quad.pos[i].x, quad.pos[i].y, 1 ) );
+	memcpy( quad.tri, tri, sizeof( tri ) );
+	quad.N[0] = quad.N[1] = vec3( 0, 0, 1 );
+	quad.material = &material;
+	quad.UpdateBounds();
+	Surface* target = new Surface( SCRWIDTH, SCRHEIGHT );
+	RenderContext* context = new RenderContext( target );
+	printf( "shading: %i frames of a full-screen quad, %ix%i texture\n", frames, size, size );
+	for( int mode = 0; mode < 3; mode++ )
+	{
+		mat4 transform;
+		material.format = format[mode], material.filter = filter[mode];
+		timer t;
+		for( int i = 0; i < frames; i++ )
+			context->ClearDepth( 0, SCRHEIGHT ),
+			quad.Render( transform, *context );
+		const float time = t.elapsed();
+		printf( "%s: %6.2fms per frame, %6.1f Mpixels/s\n", name[mode], time / frames, (SCRWIDTH * SCRHEIGHT * frames) / (time * 1000) );
+	}
+	delete context;
+	delete target;
+}
+
+// -----------------------------------------------------------
+// BenchmarkScaling
+// times the data-parallel loops on 1..N threads: clearing and
+// resizing a large surface, the vertex transform of a large
+// mesh, and its bounds. the job manager is recreated for each
+// thread count, and restored afterwards.
+// -----------------------------------------------------------
+void BenchmarkScaling()
+{
+	const int size = 2048, verts = 1 << 20, runs = 20;
+	Surface* big = new Surface( size, size ), *half = new Surface( size / 2, size / 2 );
+	Material material; // no texture: Mesh::Render stops after the vertex transform
+	Mesh mesh( verts, 1 );
+	for( int i = 0; i < verts; i++ ) mesh.pos[i] = vec3( Rand( 1 ) - 0.5f, Rand( 1 ) - 0.5f, -1 - Rand( 1 ) );
+	mesh.material = &material;
+	mesh.UpdateBounds();
+	Surface* target = new Surface( SCRWIDTH, SCRHEIGHT );
+	RenderContext* context = new RenderContext( target );
+	const unsigned int cores = MAX( 1u, std::thread::hardware_concurrency() );
+	printf( "scaling: %ix%i clear and resize, %i vertices; ms per run\n", size, size, verts );
+	printf( "threads   clear  resize  transform  bounds\n" );
+	for( unsigned int threads = 1, last = 0; last < cores; last = threads, threads = MIN( threads * 2, cores ) )
+	{
+		delete JobManager::GetJobManager();
+		JobManager::CreateJobManager( threads );
+		float time[4] = { 0 };
+		mat4 transform;
+		timer t;
+		for( int i = 0; i < runs; i++ ) big->Clear( i );
+		time[0] = t.elapsed(), t.reset();
+		for( int i = 0; i < runs; i++ ) half->Resize( big );
+		time[1] = t.elapsed(), t.reset();
+		for( int i = 0; i < runs; i++ ) mesh.Render( transform, *context );
+		time[2] = t.elapsed(), t.reset();
+		for( int i = 0; i < runs; i++ ) mesh.UpdateBounds();
+		time[3] = t.elapsed();
+		printf( "%7i %7.2f %7.2f %10.2f %7.2f\n", threads, time[0] / runs, time[1] / runs, time[2] / runs, time[3] / runs );
+	}
+	delete JobManager::GetJobManager();
+	JobManager::CreateJobManager();
+	delete context;
+	delete target;
+	delete big;
+	delete half;
+}
+
+// -----------------------------------------------------------
+// BenchmarkDispatch
+// dispatch latency of the job system: batches of 1000 empty
+// jobs, added and waited for by a worker (own deque, stolen
+// by the others) and by a thread that is not a worker (the
+// injection queue). reports the time per batch and per job.
+// -----------------------------------------------------------
+struct EmptyJob : public Job { void Main() {} };
+void BenchmarkDispatch()
+{
+	const int jobs = 1000, runs = 200;
+	const char* name[2] = { "from a worker", "from another thread" };
+	JobManager* jm = JobManager::GetJobManager();
+	EmptyJob* job = new EmptyJob[jobs];
+	printf( "dispatch: %i empty jobs on %i threads\n", jobs, jm->GetNumThreads() );
+	for( int pass = 0; pass < 2; pass++ )
+	{
+		float time = 0;
+		auto batches = [&]()
+		{
+			timer t;
+			for( int r = 0; r <= runs; r++ )
+			{
+				if (r == 1) t.reset(); // first batch is a warm-up
+				JobCounter counter;
+				for( int i = 0; i < jobs; i++ ) jm->AddJob2( &job[i], &counter );
+				jm->Wait( &counter );
+			}
+			time = t.elapsed();
+		};
+		if (pass == 0) batches(); else std::thread( batches ).join();
+		printf( "%s: %7.1fus per batch, %6.1fns per job\n", name[pass], (time * 1000) / runs, (time * 1000000) / (runs * jobs) );
+	}
+	delete[] job;
+}
+
+// -----------------------------------------------------------
+// SplineCameras
+// cameras at evenly spaced vertices of the camera path in
+// spline.dat, or the default camera if there is no path
+// -----------------------------------------------------------
+static vector<Camera> SplineCameras( int count )
+{
+	vector<vec3> pos, target;
+	FILE* f = fopen( "spline.dat", "rb" );
+	if (f)
+	{
+		vec3 p, t;
+		while (fread( &p, sizeof( vec3 ), 1, f ) && fread( &t, sizeof( vec3 ), 1, f )) pos.push_back( p ), target.push_back( t );
+		fclose( f );
+	}
+	if (pos.empty()) pos.push_back( vec3( 0, 0, 8 ) ), target.push_back( vec3( 0 ) );
+	vector<Camera> cameras( MIN( count, (int)pos.size() ) );
+	for( uint i = 0; i < cameras.size(); i++ )
+	{
+		const uint v = i * (uint)pos.size() / (uint)cameras.size();
+		cameras[i].SetPosition( pos[v] );
+		cameras[i].LookAt( target[v] );
+	}
+	return cameras;
+}
+
+// -----------------------------------------------------------
+// TracePrimary
+// one primary ray per pixel from each camera, on all workers;
+// query traces a ray and returns whether it hit anything.
+// returns the ray rate in Mrays/s.
+// -----------------------------------------------------------
+template <class Query> static float TracePrimary( Raytracer* raytracer, vector<Camera>& cameras, const Query& query )
+{
+	std::atomic<uint> hits( 0 );
+	timer t;
+	for( uint c = 0; c < cameras.size(); c++ ) parallel_for( 0, SCRHEIGHT, 4, [&]( int first, int last )
+	{
+		uint h = 0;
+		for( int y = first; y < last; y++ ) for( int x = 0; x < SCRWIDTH; x++ )
+		{
+			Ray ray = raytracer->PrimaryRay( cameras[c], x + 0.5f, y + 0.5f );
+			h += query( ray );
+		}
+		hits += h;
+	} );
+	const float time = t.elapsed();
+	sink = hits;
+	return (SCRWIDTH * SCRHEIGHT * cameras.size()) / (time * 1000);
+}
+
+// -----------------------------------------------------------
+// BenchmarkBVH
+// build time versus trace performance of the BVH build modes
+// over the scene: binned SAH on one worker and on all workers,
+// and LBVH. traces one primary ray per pixel (nearest hit, no
+// shading) from cameras along the camera path, on all workers.
+// -----------------------------------------------------------
+void BenchmarkBVH( Raytracer* raytracer )
+{
+	const char* name[3] = { "SAH, 1 thread", "SAH", "LBVH" };
+	const int mode[3] = { BVH::SAH, BVH::SAH, BVH::LBVH };
+	vector<Camera> cameras = SplineCameras( 16 );
+	BVH bvh; // the tracer keeps its own
+	printf( "bvh: %i cameras, %ix%i primary rays each\n", (int)cameras.size(), SCRWIDTH, SCRHEIGHT );
+	printf( "mode            build ms    nodes  SAH cost  Mrays/s\n" );
+	for( int i = 0; i < 3; i++ )
+	{
+		if (i == 0) delete JobManager::GetJobManager(), JobManager::CreateJobManager( 1 );
+		bvh.Build( raytracer->scene, mode[i] );
+		if (i == 0) delete JobManager::GetJobManager(), JobManager::CreateJobManager();
+		const float rate = TracePrimary( raytracer, cameras, [&]( Ray& ray ) { bvh.Intersect( ray ); return ray.prim >= 0; } );
+		printf( "%-14s %9.1f %8i %9.2f %8.2f\n", name[i], bvh.buildTime, bvh.nodesUsed - 1, bvh.SAHCost(), rate );
+	}
+}
+
+// -----------------------------------------------------------
+// BenchmarkBVH8
+// traversal speed of the binary BVH versus the 8-wide BVH that
+// is collapsed from it: one primary ray per pixel from cameras
+// along the camera path, as nearest-hit and as any-hit
+// (occlusion) queries, on all workers.
+// -----------------------------------------------------------
+void BenchmarkBVH8( Raytracer* raytracer )
+{
+	vector<Camera> cameras = SplineCameras( 32 );
+	BVH& bvh = raytracer->bvh;
+	BVH8& bvh8 = raytracer->bvh8;
+	printf( "bvh8: %i cameras, %ix%i primary rays each; %i nodes (binary: %i), collapsed in %.1fms\n", (int)cameras.size(),
+		SCRWIDTH, SCRHEIGHT, bvh8.nodesUsed, bvh.nodesUsed - 1, bvh8.buildTime );
+	printf( "Mrays/s     binary  8-wide  speedup\n" );
+	const float nearest[2] = {
+		TracePrimary( raytracer, cameras, [&]( Ray& ray ) { bvh.Intersect( ray ); return ray.prim >= 0; } ),
+		TracePrimary( raytracer, cameras, [&]( Ray& ray ) { bvh8.Intersect( ray ); return ray.prim >= 0; } ) };
+	printf( "%-10s %7.2f %7.2f %7.2fx\n", "nearest", nearest[0], nearest[1], nearest[1] / nearest[0] );
+	const float occlusion[2] = {
+		TracePrimary( raytracer, cameras, [&]( Ray& ray ) { return bvh.IsOccluded( ray ); } ),
+		TracePrimary( raytracer, cameras, [&]( Ray& ray ) { return bvh8.IsOccluded( ray ); } ) };
+	printf( "%-10s %7.2f %7.2f %7.2fx\n", "occlusion", occlusion[0], occlusion[1], occlusion[1] / occlusion[0] );
+}
+
+// -----------------------------------------------------------
+// BenchmarkPackets
+// Raytracer::Render with 8x8 ray packets per screen tile versus
+// single rays, from cameras along the camera path; reports the
+// time per frame (including shading), the primary ray rate, and
+// the share of packets that diverged and were completed with
+// single rays.
+// -----------------------------------------------------------
+void BenchmarkPackets( Raytracer* raytracer )
+{
+	vector<Camera> cameras = SplineCameras( 32 );
+	printf( "packets: %i cameras, %ix%i pixels, %ix%i rays per packet\n", (int)cameras.size(), SCRWIDTH, SCRHEIGHT, PACKET_SIZE, PACKET_SIZE );
+	float time[2];
+	for( int packets = 0; packets < 2; packets++ )
+	{
+		raytracer->packets = packets == 1;
+		raytracer->packetCount = raytracer->divergedCount = 0;
+		timer t;
+		for( uint c = 0; c < cameras.size(); c++ ) raytracer->Render( cameras[c] );
+		time[packets] = t.elapsed() / cameras.size();
+		printf( "%-12s %6.2fms per frame, %6.2f Mrays/s", packets ? "packets:" : "single rays:", time[packets], (SCRWIDTH * SCRHEIGHT) / (time[packets] * 1000) );
+		if (packets) printf( ", %.1f%% diverged, %.2fx", (100.0f * raytracer->divergedCount) / MAX( 1, (int)raytracer->packetCount ), time[0] / time[1] );
+		printf( "\n" );
+	}
+	raytracer->packets = true;
+}
+
+// -----------------------------------------------------------
+// BenchmarkStreaming
+// texture residency under a budget of the palette memory plus
+// a quarter of the texel memory of the loaded scene (residency
+// counts both): loads the scene file again with
+// streamed textures, renders the camera path with a rasterizer
+// and reports the resident texture memory against the budget,
+// and the bytes streamed in and evicted.
+// -----------------------------------------------------------
+void BenchmarkStreaming( Scene* scene, const char* file )
+{
+	int64 texels = 0;
+	for( uint i = 0; i < scene->texList.size(); i++ ) texels += scene->texList[i]->pixels->GetResidentBytes();
+	if (!texels) return;
+	Surface* target = new Surface( SCRWIDTH, SCRHEIGHT );
+	Rasterizer* rasterizer = new Rasterizer();
+	rasterizer->Init( target );
+	TextureResidency& residency = rasterizer->scene->residency;
+	residency.budget = texels / 4 + PalettePool::GetBytes();
+	rasterizer->scene->Add( (char*)file );
+	vector<Camera> cameras = SplineCameras( 32 );
+	const int frames = 8; // per camera, for the levels to arrive at STREAM_RATE
+	printf( "streaming: %i cameras, %i frames each, budget %.1fMB of %.1fMB texels\n", (int)cameras.size(), frames, residency.budget / 1048576.0f, texels / 1048576.0f );
+	int64 peak = 0;
+	timer t;
+	for( uint c = 0; c < cameras.size(); c++ )
+	{
+		for( int i = 0; i < frames; i++ ) rasterizer->Render( cameras[c] ), peak = MAX( peak, residency.resident );
+		if ((c & 7) == 7) printf( "camera %2i: %7.1fKB resident, %5.1f%% of budget\n", c + 1, residency.resident / 1024.0f, (100.0f * residency.resident) / residency.budget );
+	}
+	const float time = t.elapsed() / (cameras.size() * frames);
+	printf( "peak %.1fKB (%.1f%% of budget), %.1fMB streamed in, %.1fMB evicted, %6.2fms per frame\n", peak / 1024.0f,
+		(100.0f * peak) / residency.budget, residency.streamed / 1048576.0f, residency.evicted / 1048576.0f, time );
+	delete rasterizer;
+	delete target;
+}
+
+}; // namespace Tmpl8
@@ -0,0 +1,25 @@
+// Template, UU version
+// IGAD/NHTV/UU - Jacco Bikker - 2006-2018
+
+#pragma once
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Benchmarks
+// standalone measurements, printed to the console; executed
+// by Game::Init when BENCHMARK is defined in precomp.h, after
+// the scene has been loaded from file
+// -----------------------------------------------------------
+void RunBenchmarks( Scene* scene, const char* file );
+void BenchmarkTexelLayout();
+void BenchmarkTextureFormat();
+void BenchmarkShading();
+void BenchmarkScaling();
+void BenchmarkDispatch();
+void BenchmarkBVH( Raytracer* raytracer );
+void BenchmarkBVH8( Raytracer* raytracer );
+void BenchmarkPackets( Raytracer* raytracer );
+void BenchmarkStreaming( Scene* scene, const char* file );
+
+}; // namespace Tmpl8
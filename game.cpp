@@ -1,14 +1,23 @@
 #include "precomp.h" // include (only) this in every .cpp file
 
 Rasterizer rasterizer;
+Raytracer raytracer;
 Camera camera;
 vec3 position;
+static const char* sceneFile = "assets/unity_full/unityScene.obj";
 
 // -----------------------------------------------------------
 // Initialize the application
 // -----------------------------------------------------------
 void Game::Init()
 {
+	// start the job manager: one worker per hardware thread
+	JobManager::CreateJobManager();
+#ifdef VERBOSE
+	const CpuTopology& cpus = JobManager::GetTopology();
+	printf( "jobs: %i workers on %i logical processors, %i cores, %i packages, %i L3 domains, %i NUMA nodes\n",
+		JobManager::GetJobManager()->GetNumThreads(), (int)cpus.cpu.size(), cpus.cores, cpus.packages, cpus.l3s, cpus.nodes );
+#endif
 	// initialize rasterizer
 	rasterizer.Init( screen );
 	// setup camera (note: in ogl/glm, z for 'far' is -inf)
@@ -16,7 +25,15 @@ void Game::Init()
 	camera.SetPosition( position );
 	camera.LookAt( vec3( 0, 0, 0 ) );
 	// initialize scene
-	rasterizer.scene->Add( "assets/unity_full/unityScene.obj" );
+	rasterizer.scene->Add( (char*)sceneFile );
+#ifdef RAYTRACE
+	// the raytracer shares the scene of the rasterizer; the benchmarks build their own
+	raytracer.scene = rasterizer.scene;
+	raytracer.Init( screen );
+#endif
+#ifdef BENCHMARK
+	RunBenchmarks( rasterizer.scene, sceneFile );
+#endif
 	// load the camera, if possible
 	FILE* f = fopen( "camera.dat", "rb" );
 	if (!f) return;
@@ -92,6 +109,9 @@ void Game::Tick( float deltaTime )
 	// update path time
 	if ((t += 0.02f) >= 1) /* next segment */ t -= 1, C = (++C >= N ? 0 : C);
 #endif
-	screen->Clear( 0 );
+#ifdef RAYTRACE
+	raytracer.Render( camera );
+#else
 	rasterizer.Render( camera );
+#endif
 }
\ No newline at end of file
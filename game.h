@@ -15,7 +15,7 @@ public:
 	void MouseDown( int button ) { /* implement if you want to detect mouse button presses */ }
 	void MouseMove( int x, int y ) { /* implement if you want to detect mouse movement */ }
 	void KeyUp( int key ) { /* implement if you want to handle keys */ }
-	void KeyDown( int key ) { /* implement if you want to handle keys */ }
+	void KeyDown( int key ) { if (key == SDL_SCANCODE_P) JobProfiler::Capture( 10, "trace.json" ); /* P: profile 10 frames */ }
 	vec3 Spline( vec3 p0, vec3 p1, vec3 p2, vec3 p3, float t )
 	{
 		float t01 = sqrtf( (p1 - p0).length() );
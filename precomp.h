@@ -8,6 +8,24 @@
 #define SCRHEIGHT		512
 // #define FULLSCREEN
 // #define ADVANCEDGL	// faster if your system supports it
+#define OPTIMIZE_MESHES	// reorder mesh data for vertex locality at load time
+// #define COMPRESS_MESHES	// store quantized vertex data (lossy; ~4x smaller)
+// #define COMPRESS_TEXTURES	// store large textures as 4-bit blocks (lossy; 25% smaller)
+// #define TRUECOLOR_TEXTURES	// render all materials from 32-bit textures, with per-vertex lighting
+// #define BILINEAR_TEXTURES	// filter magnified textures bilinearly (per material: 'filter bilinear' in the .mtl)
+// #define BENCHMARK		// run the benchmarks in benchmark.cpp at startup
+// #define VERBOSE		// print load and build statistics to the console (implied by BENCHMARK)
+// #define RAYTRACE		// draw frames with the raytracer instead of the rasterizer
+#define BVH8_TRACE		// raytracer queries use the 8-wide BVH (the raytracer needs AVX2 and FMA either way)
+#define FRAME_BUFFERS	3	// frames in flight between rendering and presenting (2: double, 3: triple buffering)
+// #define PIN_WORKERS		// pin job workers to logical processors, filling NUMA node 0 first
+
+#if defined(BENCHMARK) && !defined(VERBOSE)
+#define VERBOSE
+#endif
+#if defined(_WIN32) && !defined(_WIN32_WINNT)
+#define _WIN32_WINNT	0x0602	// Windows 8, for WaitOnAddress
+#endif
 
 #include <inttypes.h>
 extern "C" 
@@ -27,15 +45,35 @@ extern "C"
 #include "emmintrin.h"
 #include "immintrin.h"
 #include "windows.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#endif
+#include <assert.h>
+#include <limits.h>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include "template.h"
 #include "surface.h"
 #include "threads.h"
-#include <assert.h>
-#include <vector>
 
 using namespace std;
 using namespace Tmpl8;
 
 #include "rasterizer.h"
 #include "raytracer.h"
-#include "game.h"
\ No newline at end of file
+#include "game.h"
+#include "benchmark.h"
\ No newline at end of file
@@ -1,44 +1,601 @@
 #include "precomp.h"
 
-// -----------------------------------------------------------
-// static data for the rasterizer
-// -----------------------------------------------------------
-Surface* Mesh::screen = 0;
-float* Mesh::xleft, *Mesh::xright, *Mesh::uleft, *Mesh::uright;
-float* Mesh::vleft, *Mesh::vright, *Mesh::zleft, *Mesh::zright;
-float* Rasterizer::zbuffer;
-vec4 Rasterizer::frustum[5];
 static vec3 raxis[3] = { vec3( 1, 0, 0  ), vec3( 0, 1, 0 ), vec3( 0, 0, 1 ) };
 
 // -----------------------------------------------------------
 // Tiny functions
 // -----------------------------------------------------------
-Texture::Texture( char* file ) : name( 0 ) { pixels = new Surface8( file ); SetName( file ); }
-Texture::~Texture() { delete pixels; delete name; }
-void Texture::SetName( const char* n ) { delete name; strcpy( name = new char[strlen( n ) + 1], n ); }
-Material::~Material() { delete name; }
-void Material::SetName( char* n ) { delete name; strcpy( name = new char[strlen( n ) + 1], n ); }
-SGNode::~SGNode() { for( uint i = 0; i < child.size(); i++ ) delete child[i]; }
-Rasterizer::~Rasterizer() { delete scene; }
-Mesh::~Mesh() { delete pos; delete N; delete spos; delete tri; }
+Texture::~Texture() { delete pixels; UnloadTruecolor(); }
+void Texture::UnloadTruecolor() { for( int i = 0; i < rgbaLevels; i++ ) delete rgba[i]; rgbaLevels = 0; }
+void Material::SetFormat( int f ) { if (((format = f) == TRUECOLOR) && texture) texture->LoadTruecolor(); }
+SGNode::~SGNode() { for( uint i = 0; i < child.size(); i++ ) if (!child[i]->arena) delete child[i]; }
+void SGNode::Destroy( SGNode* node ) { if (node->arena) node->~SGNode(); else delete node; }
+Rasterizer::~Rasterizer() { delete scene; delete context; FREE64( scratch ); FREE64( bins ); }
+
+// -----------------------------------------------------------
+// Texture::LoadTruecolor
+// loads the source image of the texture as 32-bit texels, for
+// TRUECOLOR materials
+// -----------------------------------------------------------
+void Texture::LoadTruecolor()
+{
+	if (rgbaLevels || !name) return;
+	Surface* level0 = new Surface( name );
+	if (level0->GetBuffer()) BuildTruecolor( level0 ); else delete level0;
+}
+
+// -----------------------------------------------------------
+// Texture::BuildTruecolor
+// builds the truecolor mip chain by box filtering; takes
+// ownership of level 0
+// -----------------------------------------------------------
+void Texture::BuildTruecolor( Surface* level0 )
+{
+	UnloadTruecolor();
+	rgba[rgbaLevels++] = level0;
+	while (rgbaLevels < MAX_MIPS)
+	{
+		Surface* src = rgba[rgbaLevels - 1];
+		const int pw = src->GetWidth(), ph = src->GetHeight(), w = max( 1, pw >> 1 ), h = max( 1, ph >> 1 );
+		if ((pw == 1) && (ph == 1)) break;
+		Surface* dst = rgba[rgbaLevels++] = new Surface( w, h );
+		const Pixel* s = src->GetBuffer();
+		for( int y = 0; y < h; y++ ) for( int x = 0; x < w; x++ )
+		{
+			const int x0 = min( x * 2, pw - 1 ), x1 = min( x * 2 + 1, pw - 1 );
+			const int y0 = min( y * 2, ph - 1 ) * pw, y1 = min( y * 2 + 1, ph - 1 ) * pw;
+			const Pixel c[4] = { s[x0 + y0], s[x1 + y0], s[x0 + y1], s[x1 + y1] };
+			uint rb = 0, ag = 0;
+			for( int i = 0; i < 4; i++ ) rb += c[i] & 0xff00ff, ag += (c[i] >> 8) & 0xff00ff;
+			dst->GetBuffer()[x + y * w] = (((rb + 0x20002) >> 2) & 0xff00ff) + ((((ag + 0x20002) >> 2) & 0xff00ff) << 8);
+		}
+	}
+}
+
+
+// -----------------------------------------------------------
+// RenderContext
+// allocates the zbuffer and outline tables for the target, and
+// calculates the view frustum planes for its resolution. the
+// zbuffer is left to the first clear, so that its pages are
+// first touched by the workers that clear them every frame.
+// -----------------------------------------------------------
+RenderContext::RenderContext( Surface* target ) : screen( target ), width( target->GetWidth() ), height( target->GetHeight() ), tscratch( 0 ), tscratchSize( 0 ),
+	requests( 0 ), requestSlots( 0 )
+{
+	// setup outline tables & zbuffer
+	xleft = new float[height], xright = new float[height];
+	uleft = new float[height], uright = new float[height];
+	vleft = new float[height], vright = new float[height];
+	zleft = new float[height], zright = new float[height];
+	lleft = new float[height], lright = new float[height];
+	for( int y = 0; y < height; y++ ) xleft[y] = (float)(width - 1), xright[y] = 0;
+	zbuffer = (float*)MALLOC64( width * height * sizeof( float ) );
+	// calculate view frustum planes
+	const float W = (float)width, H = (float)height;
+	float C = -1.0f, x1 = 0.5f, x2 = W - 1.5f, y1 = 0.5f, y2 = H - 1.5f;
+	vec3 p0 = { 0, 0, 0 };
+	vec3 p1 = { ((x1 - W / 2) * C) / W, ((y1 - H / 2) * C) / W, 1.0f };
+	vec3 p2 = { ((x2 - W / 2) * C) / W, ((y1 - H / 2) * C) / W, 1.0f };
+	vec3 p3 = { ((x2 - W / 2) * C) / W, ((y2 - H / 2) * C) / W, 1.0f };
+	vec3 p4 = { ((x1 - W / 2) * C) / W, ((y2 - H / 2) * C) / W, 1.0f };
+	frustum[0] = { 0, 0, -1, 0.2f };
+	frustum[1] = vec4( normalize( cross( p1 - p0, p4 - p1 ) ), 0 ); // left plane
+	frustum[2] = vec4( normalize( cross( p2 - p0, p1 - p2 ) ), 0 ); // top plane
+	frustum[3] = vec4( normalize( cross( p3 - p0, p2 - p3 ) ), 0 ); // right plane
+	frustum[4] = vec4( normalize( cross( p4 - p0, p3 - p4 ) ), 0 ); // bottom plane
+}
+
+RenderContext::~RenderContext()
+{
+	delete[] xleft, delete[] xright, delete[] uleft, delete[] uright, delete[] vleft;
+	delete[] vright, delete[] zleft, delete[] zright, delete[] lleft, delete[] lright;
+	FREE64( zbuffer );
+	FREE64( tscratch );
+	delete[] requests;
+}
+
+void RenderContext::Clear( int y0, int y1 )
+{
+	ClearDepth( y0, y1 );
+	for( int y = y0; y < y1; y++ ) memset( screen->GetBuffer() + y * screen->GetPitch(), 0, width * sizeof( Pixel ) );
+}
+
+vec3* RenderContext::GetScratch( int verts )
+{
+	if (verts > tscratchSize) FREE64( tscratch ), tscratch = (vec3*)MALLOC64( verts * sizeof( vec3 ) ), tscratchSize = verts;
+	return tscratch;
+}
+
+// -----------------------------------------------------------
+// RenderContext mip requests
+// per texture of the scene, the finest level wanted since the
+// last residency update; TextureResidency::EndFrame takes them.
+// raster tasks of a frame may report concurrently, hence the
+// atomic minimum. the table only grows outside of a frame
+// (PrepareRequests), or for Mesh::Render, which draws on the
+// thread that owns the context.
+// -----------------------------------------------------------
+void RenderContext::PrepareRequests( int textures )
+{
+	if (textures <= requestSlots) return;
+	std::atomic<int>* grown = new std::atomic<int>[textures];
+	for( int i = 0; i < textures; i++ ) grown[i] = (i < requestSlots) ? requests[i].load() : MAX_MIPS;
+	delete[] requests, requests = grown, requestSlots = textures;
+}
+
+// records a wanted level; returns the level to sample: the wanted
+// one, or the finest resident level if that is coarser
+int RenderContext::Request( Texture* texture, int level )
+{
+	const int i = texture->index;
+	if (i >= 0)
+	{
+		if (i >= requestSlots) PrepareRequests( i + 1 );
+		int current = requests[i].load( std::memory_order_relaxed );
+		while ((level < current) && !requests[i].compare_exchange_weak( current, level, std::memory_order_relaxed ));
+	}
+	return max( level, texture->pixels->GetResidentLevel() );
+}
+
+// -----------------------------------------------------------
+// Mesh data storage
+// all arrays of a mesh share a single 64-byte aligned block,
+// taken from the mesh store (an arena) or from the heap.
+// -----------------------------------------------------------
+static size_t Align64( size_t s ) { return (s + 63) & ~(size_t)63; }
+static void* AllocBlock( Arena* store, size_t size ) { return store ? store->Alloc( size ) : MALLOC64( size ); }
+static void FreeBlock( Arena* store, void* block ) { if (!store && block) FREE64( block ); }
+Mesh::~Mesh() { FreeBlock( store, block ); }
 
 // -----------------------------------------------------------
 // Mesh constructor
+// input: vertex count & face count, arena for node and data
+// -----------------------------------------------------------
+Mesh::Mesh( int vcount, int tcount, Arena* a ) : SGNode( a ), store( a ), block( 0 )
+{
+	Allocate( vcount, tcount );
+}
+
+// -----------------------------------------------------------
+// Mesh::Allocate
 // input: vertex count & face count
-// allocates room for mesh data: 
+// allocates room for mesh data, in a single block: 
 // - pos:  vertex positions
-// - tpos: transformed vertex positions
 // - norm: vertex normals
 // - spos: vertex screen space positions
 // - uv:   vertex uv coordinates
 // - N:    face normals
 // - tri:  connectivity data
 // -----------------------------------------------------------
-Mesh::Mesh( int vcount, int tcount ) : verts( vcount ), tris( tcount )
+void Mesh::Allocate( int vcount, int tcount )
+{
+	FreeBlock( store, block );
+	verts = vcount, tris = tcount, qvert = 0, tri16 = 0;
+	const size_t sv = Align64( vcount * sizeof( vec3 ) ), suv = Align64( vcount * sizeof( vec2 ) ), sn = Align64( tcount * sizeof( vec3 ) );
+	char* p = (char*)(block = AllocBlock( store, 2 * sv + 2 * suv + sn + tcount * 3 * sizeof( int ) ));
+	pos = (vec3*)p, norm = (vec3*)(p + sv), p += 2 * sv;
+	spos = (vec2*)p, uv = (vec2*)(p + suv), p += 2 * suv;
+	N = (vec3*)p, tri = (int*)(p + sn);
+}
+
+// -----------------------------------------------------------
+// Mesh::Relocate
+// moves the mesh data to a single block in the target arena
+// (or the heap, if target is 0)
+// -----------------------------------------------------------
+void Mesh::Relocate( Arena* target )
+{
+	void** ptr[8] = { (void**)&pos, (void**)&norm, (void**)&spos, (void**)&uv, (void**)&N, (void**)&tri, (void**)&qvert, (void**)&tri16 };
+	const size_t size[8] = { 
+		verts * sizeof( vec3 ), verts * sizeof( vec3 ), verts * sizeof( vec2 ), verts * sizeof( vec2 ),
+		tris * sizeof( vec3 ), tris * 3 * sizeof( int ), verts * sizeof( QVertex ), tris * 3 * sizeof( ushort ) 
+	};
+	size_t total = 0;
+	for( int i = 0; i < 8; i++ ) if (*ptr[i]) total += Align64( size[i] );
+	char* p = (char*)AllocBlock( target, total );
+	void* old = block;
+	Arena* oldStore = store;
+	block = p, store = target;
+	for( int i = 0; i < 8; i++ ) if (*ptr[i]) memcpy( p, *ptr[i], size[i] ), *ptr[i] = p, p += Align64( size[i] );
+	FreeBlock( oldStore, old ); // after the copy: the arrays lived in the old block
+}
+
+// -----------------------------------------------------------
+// Octahedral normal encoding
+// maps a unit vector to two bytes (Cigolle et al., 'A survey
+// of efficient representations for independent unit vectors');
+// degenerate normals (zero length, or not a number) encode +Z
+// -----------------------------------------------------------
+static void OctEncode( const vec3& n, uchar& ox, uchar& oy )
+{
+	const float l1 = fabsf( n.x ) + fabsf( n.y ) + fabsf( n.z );
+	if (!(l1 > 0)) { ox = oy = 128; return; }
+	float x = n.x / l1, y = n.y / l1;
+	if (n.z < 0)
+	{
+		const float fx = (1 - fabsf( y )) * (x >= 0 ? 1 : -1), fy = (1 - fabsf( x )) * (y >= 0 ? 1 : -1);
+		x = fx, y = fy;
+	}
+	ox = (uchar)(int)((x * 0.5f + 0.5f) * 255 + 0.5f), oy = (uchar)(int)((y * 0.5f + 0.5f) * 255 + 0.5f);
+}
+static vec3 OctDecode( uchar ox, uchar oy )
+{
+	vec3 n( ox * (2.0f / 255) - 1, oy * (2.0f / 255) - 1, 0 );
+	n.z = 1 - fabsf( n.x ) - fabsf( n.y );
+	if (n.z < 0)
+	{
+		const float fx = (1 - fabsf( n.y )) * (n.x >= 0 ? 1 : -1), fy = (1 - fabsf( n.x )) * (n.y >= 0 ? 1 : -1);
+		n.x = fx, n.y = fy;
+	}
+	return normalize( n );
+}
+
+// -----------------------------------------------------------
+// Mesh::Compress
+// replaces the float vertex data by QVertex records (12 bytes
+// instead of 40 per vertex): positions are quantized to 16 bits
+// within the mesh bounds, uvs to 16 bits within the uv range of
+// the mesh, normals are octahedral-encoded in two bytes. meshes
+// with at most 64K vertices also get 16-bit indices.
+// positions are decoded in the transform stage of Mesh::Render;
+// uvs and normals are decoded where the raster stage reads them,
+// per triangle corner.
+// -----------------------------------------------------------
+void Mesh::Compress()
+{
+	if (qvert || !verts) return;
+	vec2 uvmin( 1e30f ), uvmax( -1e30f );
+	for( int i = 0; i < verts; i++ )
+		uvmin.x = min( uvmin.x, uv[i].x ), uvmax.x = max( uvmax.x, uv[i].x ),
+		uvmin.y = min( uvmin.y, uv[i].y ), uvmax.y = max( uvmax.y, uv[i].y );
+	uvBase = uvmin, uvScale = (uvmax - uvmin) * (1.0f / 65535);
+	const vec3 e = bounds[1] - bounds[0];
+	const vec3 s( e.x > 0 ? 65535 / e.x : 0, e.y > 0 ? 65535 / e.y : 0, e.z > 0 ? 65535 / e.z : 0 );
+	const float su = uvScale.x > 0 ? 1 / uvScale.x : 0, sv = uvScale.y > 0 ? 1 / uvScale.y : 0;
+	const bool small = verts <= 65536;
+	const size_t sq = Align64( verts * sizeof( QVertex ) ), sn = Align64( tris * sizeof( vec3 ) );
+	void* old = block;
+	char* p = (char*)(block = AllocBlock( store, sq + sn + tris * 3 * (small ? sizeof( ushort ) : sizeof( int )) ));
+	qvert = (QVertex*)p;
+	for( int i = 0; i < verts; i++ )
+	{
+		QVertex& q = qvert[i];
+		const vec3 p = (pos[i] - bounds[0]) * s;
+		q.x = (ushort)(p.x + 0.5f), q.y = (ushort)(p.y + 0.5f), q.z = (ushort)(p.z + 0.5f);
+		q.u = (ushort)((uv[i].x - uvBase.x) * su + 0.5f), q.v = (ushort)((uv[i].y - uvBase.y) * sv + 0.5f);
+		OctEncode( norm[i], q.nx, q.ny );
+	}
+	memcpy( p + sq, N, tris * sizeof( vec3 ) ), N = (vec3*)(p + sq);
+	if (small)
+	{
+		tri16 = (ushort*)(p + sq + sn);
+		for( int i = 0; i < tris * 3; i++ ) tri16[i] = (ushort)tri[i];
+		tri = 0;
+	}
+	else memcpy( p + sq + sn, tri, tris * 3 * sizeof( int ) ), tri = (int*)(p + sq + sn);
+	FreeBlock( store, old );
+	pos = norm = 0, uv = spos = 0;
+}
+
+// -----------------------------------------------------------
+// Mesh::GetPos / GetNormal
+// vertex access that works for float and compressed meshes
+// -----------------------------------------------------------
+vec3 Mesh::GetPos( int i )
+{
+	if (!qvert) return pos[i];
+	const vec3 e = (bounds[1] - bounds[0]) * (1.0f / 65535);
+	return bounds[0] + vec3( qvert[i].x * e.x, qvert[i].y * e.y, qvert[i].z * e.z );
+}
+vec3 Mesh::GetNormal( int i )
+{
+	return qvert ? OctDecode( qvert[i].nx, qvert[i].ny ) : norm[i];
+}
+
+// -----------------------------------------------------------
+// Mesh::MemoryUsage
+// returns the number of bytes used by the mesh geometry
+// -----------------------------------------------------------
+int Mesh::MemoryUsage()
+{
+	if (!qvert) return verts * (2 * sizeof( vec3 ) + 2 * sizeof( vec2 )) + tris * (3 * sizeof( int ) + sizeof( vec3 ));
+	return verts * sizeof( QVertex ) + tris * (3 * (tri16 ? sizeof( ushort ) : sizeof( int )) + sizeof( vec3 ));
+}
+
+// -----------------------------------------------------------
+// Mesh::UpdateBounds
+// calculates the object-space bounds of the mesh
+// -----------------------------------------------------------
+void Mesh::UpdateBounds()
+{
+	typedef std::pair<vec3, vec3> Box;
+	const Box empty( vec3( 1e30f, 1e30f, 1e30f ), vec3( -1e30f, -1e30f, -1e30f ) );
+	const Box box = parallel_reduce( 0, verts, 16384, empty, [this, &empty]( int first, int last )
+	{
+		Box b = empty;
+		for( int i = first; i < last; i++ )
+			b.first.x = min( b.first.x, pos[i].x ), b.second.x = max( b.second.x, pos[i].x ),
+			b.first.y = min( b.first.y, pos[i].y ), b.second.y = max( b.second.y, pos[i].y ),
+			b.first.z = min( b.first.z, pos[i].z ), b.second.z = max( b.second.z, pos[i].z );
+		return b;
+	}, []( const Box& a, const Box& b )
+	{
+		return Box( vec3( min( a.first.x, b.first.x ), min( a.first.y, b.first.y ), min( a.first.z, b.first.z ) ),
+			vec3( max( a.second.x, b.second.x ), max( a.second.y, b.second.y ), max( a.second.z, b.second.z ) ) );
+	} );
+	bounds[0] = box.first, bounds[1] = box.second;
+}
+
+// -----------------------------------------------------------
+// Mesh::CacheMisses
+// simulates a FIFO vertex cache of VCACHE_SIZE entries over
+// the index data and returns the number of misses; a miss
+// approximates a tpos / uv fetch that is not in L1.
+// -----------------------------------------------------------
+int Mesh::CacheMisses()
+{
+	int fifo[VCACHE_SIZE], head = 0, misses = 0;
+	for( int i = 0; i < VCACHE_SIZE; i++ ) fifo[i] = -1;
+	for( int i = 0; i < tris * 3; i++ )
+	{
+		const int idx = GetIndex( i );
+		int j = 0;
+		while ((j < VCACHE_SIZE) && (fifo[j] != idx)) j++;
+		if (j < VCACHE_SIZE) continue;
+		fifo[head] = idx, head = (head + 1) % VCACHE_SIZE, misses++;
+	}
+	return misses;
+}
+
+// -----------------------------------------------------------
+// Mesh::Optimize
+// reorders triangles for vertex reuse (Forsyth, 'Linear-speed
+// vertex cache optimisation', 2006), then renumbers vertices
+// in the order in which they are first fetched, so that the
+// tpos[tri[...]] and uv[tri[...]] reads in Render walk
+// memory (mostly) linearly.
+// -----------------------------------------------------------
+static float VertexScore( int cachePos, int liveTris )
+{
+	if (liveTris == 0) return -1; // vertex is done
+	float score = 0;
+	if (cachePos >= 0) score = (cachePos < 3) ? 0.75f : powf( 1 - (cachePos - 3) * (1.0f / (VCACHE_SIZE - 3)), 1.5f );
+	return score + 2.0f / sqrtf( (float)liveTris );
+}
+void Mesh::Optimize()
+{
+	if ((tris < 2) || qvert) return;
+	// build vertex to triangle adjacency
+	vector<int> live( verts, 0 ), offset( verts + 1, 0 ), adj( tris * 3 ), cachePos( verts, -1 ), order;
+	vector<float> vscore( verts ), tscore( tris, 0 );
+	vector<bool> emitted( tris, false );
+	for( int i = 0; i < tris * 3; i++ ) live[tri[i]]++;
+	for( int i = 0; i < verts; i++ ) offset[i + 1] = offset[i] + live[i];
+	vector<int> fill( offset.begin(), offset.end() - 1 );
+	for( int i = 0; i < tris * 3; i++ ) adj[fill[tri[i]]++] = i / 3;
+	for( int i = 0; i < verts; i++ ) vscore[i] = VertexScore( -1, live[i] );
+	for( int i = 0; i < tris * 3; i++ ) tscore[i / 3] += vscore[tri[i]];
+	// greedily emit the highest scoring triangle that touches the cache
+	int cache[VCACHE_SIZE + 3], newCache[VCACHE_SIZE + 3], cacheSize = 0, best = -1, scan = 0;
+	order.reserve( tris );
+	while ((int)order.size() < tris)
+	{
+		if (best < 0) // nothing usable in the cache: restart at the next unemitted triangle
+		{
+			while (emitted[scan]) scan++;
+			best = scan;
+		}
+		emitted[best] = true, order.push_back( best );
+		// remove the triangle from the adjacency of its vertices and push them to the front of the cache
+		int newSize = 0;
+		for( int v = 0; v < 3; v++ )
+		{
+			const int idx = tri[best * 3 + v];
+			int* a = &adj[offset[idx]], n = live[idx], j = 0;
+			while (a[j] != best) j++;
+			a[j] = a[n - 1], live[idx]--;
+			for( j = 0; j < newSize; j++ ) if (newCache[j] == idx) break;
+			if (j == newSize) newCache[newSize++] = idx;
+		}
+		for( int i = 0; i < cacheSize; i++ )
+		{
+			int j = 0;
+			while ((j < newSize) && (newCache[j] != cache[i])) j++;
+			if (j == newSize) newCache[newSize++] = cache[i];
+		}
+		// update vertex scores; propagate the delta to the triangles that use the vertex
+		for( int i = 0; i < newSize; i++ )
+		{
+			const int idx = newCache[i];
+			cachePos[idx] = (i < VCACHE_SIZE) ? i : -1;
+			const float score = VertexScore( cachePos[idx], live[idx] ), delta = score - vscore[idx];
+			vscore[idx] = score;
+			for( int j = 0; j < live[idx]; j++ ) tscore[adj[offset[idx] + j]] += delta;
+		}
+		cacheSize = min( newSize, VCACHE_SIZE );
+		memcpy( cache, newCache, cacheSize * sizeof( int ) );
+		// select the next triangle from the ones referenced by the cache
+		float bestScore = -1;
+		best = -1;
+		for( int i = 0; i < cacheSize; i++ ) for( int j = 0; j < live[cache[i]]; j++ )
+		{
+			const int t = adj[offset[cache[i]] + j];
+			if (tscore[t] > bestScore) bestScore = tscore[t], best = t;
+		}
+	}
+	// apply the new triangle order
+	vector<int> newTri( tris * 3 );
+	vector<vec3> newN( tris );
+	for( int i = 0; i < tris; i++ )
+	{
+		for( int v = 0; v < 3; v++ ) newTri[i * 3 + v] = tri[order[i] * 3 + v];
+		newN[i] = N[order[i]];
+	}
+	memcpy( N, &newN[0], tris * sizeof( vec3 ) );
+	// renumber vertices in fetch order; unreferenced vertices go last
+	vector<int> remap( verts, -1 );
+	int next = 0;
+	for( int i = 0; i < tris * 3; i++ ) if (remap[newTri[i]] < 0) remap[newTri[i]] = next++;
+	for( int i = 0; i < verts; i++ ) if (remap[i] < 0) remap[i] = next++;
+	for( int i = 0; i < tris * 3; i++ ) tri[i] = remap[newTri[i]];
+	vector<vec3> newPos( verts ), newNorm( verts );
+	vector<vec2> newUV( verts );
+	for( int i = 0; i < verts; i++ ) newPos[remap[i]] = pos[i], newNorm[remap[i]] = norm[i], newUV[remap[i]] = uv[i];
+	memcpy( pos, &newPos[0], verts * sizeof( vec3 ) );
+	memcpy( norm, &newNorm[0], verts * sizeof( vec3 ) );
+	memcpy( uv, &newUV[0], verts * sizeof( vec2 ) );
+}
+
+// -----------------------------------------------------------
+// TexelSampler
+// texture state for the bilinear span loop; texel coordinates
+// are 24.8 fixed point, with the texel center at 128.
+// -----------------------------------------------------------
+struct TexelSampler
+{
+	Pixel Fetch( int u, int v ) const
+	{
+		u &= umask, v &= vmask;
+		if (layout == Surface8::LINEAR) return pal[src[u + v * pitch]];
+		const int addr = Surface8::TiledAddress( u, v, wshift );
+		return pal[(layout == Surface8::TILED) ? src[addr] : Surface8::Block4Index( src, sub, addr )];
+	}
+	Pixel Bilinear( int fu, int fv ) const
+	{
+		const int u = fu >> 8, v = fv >> 8, wu = fu & 255, wv = fv & 255, w11 = (wu * wv) >> 8;
+		const uint w[4] = { (uint)(256 - wu - wv + w11), (uint)(wu - w11), (uint)(wv - w11), (uint)w11 };
+		const Pixel c[4] = { Fetch( u, v ), Fetch( u + 1, v ), Fetch( u, v + 1 ), Fetch( u + 1, v + 1 ) };
+		uint rb = 0, ag = 0;
+		for( int i = 0; i < 4; i++ ) rb += (c[i] & 0xff00ff) * w[i], ag += ((c[i] >> 8) & 0xff00ff) * w[i];
+		return ((rb >> 8) & 0xff00ff) + (ag & 0xff00ff00);
+	}
+	const unsigned char* src, *sub;
+	const Pixel* pal;
+	float tw256, th256;
+	int umask, vmask, wshift, pitch, layout;	// wshift: tiled levels (power of two); pitch: linear levels
+};
+
+// -----------------------------------------------------------
+// BilinearSpan
+// plots a span with bilinear filtering, four pixels per SSE
+// iteration: depth test, perspective divide and weights are
+// computed for four pixels at once; the sixteen palette
+// lookups are blended with 8-bit fixed-point weights.
+// -----------------------------------------------------------
+static void BilinearSpan( Pixel* dest, float* zbuf, int x, int x1, float u0, float v0, float z0, float du, float dv, float dz, const TexelSampler& s )
 {
-	pos = new vec3[vcount * 3], tpos = pos + vcount, norm = pos + 2 * vcount;
-	spos = new vec2[vcount * 2], uv = spos + vcount, N = new vec3[tcount];
-	tri = new int[tcount * 3];
+	const __m128 step4 = _mm_set_ps( 3, 2, 1, 0 ), one4 = _mm_set1_ps( 1 ), half4 = _mm_set1_ps( 128 );
+	const __m128 du4 = _mm_set1_ps( du ), dv4 = _mm_set1_ps( dv ), dz4 = _mm_set1_ps( dz );
+	const __m128 tw4 = _mm_set1_ps( s.tw256 ), th4 = _mm_set1_ps( s.th256 );
+	const __m128i frac4 = _mm_set1_epi32( 255 ), full4 = _mm_set1_epi32( 256 ), zero = _mm_setzero_si128();
+	for( ; x + 3 <= x1; x += 4, u0 += 4 * du, v0 += 4 * dv, z0 += 4 * dz )
+	{
+		const __m128 z4 = _mm_add_ps( _mm_set1_ps( z0 ), _mm_mul_ps( step4, dz4 ) ), zb4 = _mm_loadu_ps( zbuf + x );
+		const __m128 visible = _mm_cmplt_ps( z4, zb4 );
+		if (!_mm_movemask_ps( visible )) continue;
+		const __m128 rz4 = _mm_div_ps( one4, z4 );
+		const __m128 u4 = _mm_add_ps( _mm_set1_ps( u0 ), _mm_mul_ps( step4, du4 ) );
+		const __m128 v4 = _mm_add_ps( _mm_set1_ps( v0 ), _mm_mul_ps( step4, dv4 ) );
+		// floor, not truncate: negative coordinates must select the tap to the left of zero
+		const __m128i fu4 = _mm_cvttps_epi32( _mm_floor_ps( _mm_sub_ps( _mm_mul_ps( _mm_mul_ps( u4, rz4 ), tw4 ), half4 ) ) );
+		const __m128i fv4 = _mm_cvttps_epi32( _mm_floor_ps( _mm_sub_ps( _mm_mul_ps( _mm_mul_ps( v4, rz4 ), th4 ), half4 ) ) );
+		// weights; fractions are below 256, so a 16-bit multiply yields the full product
+		const __m128i wu4 = _mm_and_si128( fu4, frac4 ), wv4 = _mm_and_si128( fv4, frac4 );
+		const __m128i w11 = _mm_srli_epi32( _mm_mullo_epi16( wu4, wv4 ), 8 );
+		const __m128i w[4] = { _mm_add_epi32( _mm_sub_epi32( full4, _mm_add_epi32( wu4, wv4 ) ), w11 ),
+			_mm_sub_epi32( wu4, w11 ), _mm_sub_epi32( wv4, w11 ), w11 };
+		// fetch the four texels of each pixel
+		union { __m128i i4; int i[4]; } iu, iv;
+		union { __m128i c4; Pixel c[4]; } tap[4];
+		iu.i4 = _mm_srai_epi32( fu4, 8 ), iv.i4 = _mm_srai_epi32( fv4, 8 );
+		for( int i = 0; i < 4; i++ )
+		{
+			const int u = iu.i[i], v = iv.i[i];
+			tap[0].c[i] = s.Fetch( u, v ), tap[1].c[i] = s.Fetch( u + 1, v );
+			tap[2].c[i] = s.Fetch( u, v + 1 ), tap[3].c[i] = s.Fetch( u + 1, v + 1 );
+		}
+		// blend: channels widened to 16 bit, weights replicated over the channels of their pixel
+		__m128i lo = zero, hi = zero;
+		for( int i = 0; i < 4; i++ )
+		{
+			const __m128i w2 = _mm_or_si128( w[i], _mm_slli_epi32( w[i], 16 ) );
+			lo = _mm_add_epi16( lo, _mm_mullo_epi16( _mm_unpacklo_epi8( tap[i].c4, zero ), _mm_unpacklo_epi32( w2, w2 ) ) );
+			hi = _mm_add_epi16( hi, _mm_mullo_epi16( _mm_unpackhi_epi8( tap[i].c4, zero ), _mm_unpackhi_epi32( w2, w2 ) ) );
+		}
+		const __m128i color4 = _mm_packus_epi16( _mm_srli_epi16( lo, 8 ), _mm_srli_epi16( hi, 8 ) );
+		// write visible pixels
+		const __m128i mask4 = _mm_castps_si128( visible );
+		const __m128i old4 = _mm_loadu_si128( (__m128i*)(dest + x) );
+		_mm_storeu_si128( (__m128i*)(dest + x), _mm_or_si128( _mm_and_si128( mask4, color4 ), _mm_andnot_si128( mask4, old4 ) ) );
+		_mm_storeu_ps( zbuf + x, _mm_or_ps( _mm_and_ps( visible, z4 ), _mm_andnot_ps( visible, zb4 ) ) );
+	}
+	for( ; x <= x1; x++, u0 += du, v0 += dv, z0 += dz )
+	{
+		if (z0 >= zbuf[x]) continue;
+		const float z = 1.0f / z0;
+		dest[x] = s.Bilinear( (int)floorf( u0 * z * s.tw256 - 128 ), (int)floorf( v0 * z * s.th256 - 128 ) ), zbuf[x] = z0;
+	}
+}
+
+// -----------------------------------------------------------
+// TruecolorSpan
+// plots a span of 32-bit texels with per-vertex lighting, four
+// pixels per SSE2 iteration. the interpolated light level maps
+// to the same brightness range as the pre-scaled palettes, as
+// an 8.8 fixed-point scale; texels are widened to 16 bits and
+// scaled with a single _mm_mulhi_epu16, saturating at white.
+// -----------------------------------------------------------
+struct TruecolorSampler
+{
+	const Pixel* src;
+	float tw, th;
+	int umask, vmask, pitch;
+};
+static const float lightScale = (256.0f * (PALETTE_LEVELS - 1)) / ((PALETTE_LEVELS * 3) / 4);
+static const float lightBias = (256.0f * (PALETTE_LEVELS / 3)) / ((PALETTE_LEVELS * 3) / 4);
+static void TruecolorSpan( Pixel* dest, float* zbuf, int x, int x1, float u0, float v0, float z0, float l0, float du, float dv, float dz, float dl, const TruecolorSampler& s )
+{
+	const __m128 step4 = _mm_set_ps( 3, 2, 1, 0 ), one4 = _mm_set1_ps( 1 );
+	const __m128 du4 = _mm_set1_ps( du ), dv4 = _mm_set1_ps( dv ), dz4 = _mm_set1_ps( dz ), dl4 = _mm_set1_ps( dl );
+	const __m128 tw4 = _mm_set1_ps( s.tw ), th4 = _mm_set1_ps( s.th ), scale4 = _mm_set1_ps( lightScale ), bias4 = _mm_set1_ps( lightBias );
+	const __m128i umask4 = _mm_set1_epi32( s.umask ), vmask4 = _mm_set1_epi32( s.vmask ), rgb4 = _mm_set1_epi32( 0xffffff ), zero = _mm_setzero_si128();
+	for( ; x + 3 <= x1; x += 4, u0 += 4 * du, v0 += 4 * dv, z0 += 4 * dz, l0 += 4 * dl )
+	{
+		const __m128 z4 = _mm_add_ps( _mm_set1_ps( z0 ), _mm_mul_ps( step4, dz4 ) ), zb4 = _mm_loadu_ps( zbuf + x );
+		const __m128 visible = _mm_cmplt_ps( z4, zb4 );
+		if (!_mm_movemask_ps( visible )) continue;
+		const __m128 rz4 = _mm_div_ps( one4, z4 );
+		const __m128 u4 = _mm_mul_ps( _mm_mul_ps( _mm_add_ps( _mm_set1_ps( u0 ), _mm_mul_ps( step4, du4 ) ), rz4 ), tw4 );
+		const __m128 v4 = _mm_mul_ps( _mm_mul_ps( _mm_add_ps( _mm_set1_ps( v0 ), _mm_mul_ps( step4, dv4 ) ), rz4 ), th4 );
+		const __m128 l4 = _mm_mul_ps( _mm_add_ps( _mm_set1_ps( l0 ), _mm_mul_ps( step4, dl4 ) ), rz4 );
+		// texel addresses
+		const __m128i iu4 = _mm_and_si128( _mm_cvttps_epi32( u4 ), umask4 ), iv4 = _mm_and_si128( _mm_cvttps_epi32( v4 ), vmask4 );
+		union { __m128i i4; int i[4]; } iu, iv;
+		union { __m128i c4; Pixel c[4]; } texel;
+		iu.i4 = iu4, iv.i4 = iv4;
+		for( int i = 0; i < 4; i++ ) texel.c[i] = s.src[iu.i[i] + iv.i[i] * s.pitch];
+		// light: 8.8 scale per pixel, replicated over its channels
+		const __m128i light4 = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( l4, scale4 ), bias4 ) );
+		const __m128i light2 = _mm_or_si128( light4, _mm_slli_epi32( light4, 16 ) );
+		const __m128i lo = _mm_mulhi_epu16( _mm_unpacklo_epi8( zero, texel.c4 ), _mm_unpacklo_epi32( light2, light2 ) );
+		const __m128i hi = _mm_mulhi_epu16( _mm_unpackhi_epi8( zero, texel.c4 ), _mm_unpackhi_epi32( light2, light2 ) );
+		const __m128i color4 = _mm_and_si128( _mm_packus_epi16( lo, hi ), rgb4 );
+		// write visible pixels
+		const __m128i mask4 = _mm_castps_si128( visible );
+		const __m128i old4 = _mm_loadu_si128( (__m128i*)(dest + x) );
+		_mm_storeu_si128( (__m128i*)(dest + x), _mm_or_si128( _mm_and_si128( mask4, color4 ), _mm_andnot_si128( mask4, old4 ) ) );
+		_mm_storeu_ps( zbuf + x, _mm_or_ps( _mm_and_ps( visible, z4 ), _mm_andnot_ps( visible, zb4 ) ) );
+	}
+	for( ; x <= x1; x++, u0 += du, v0 += dv, z0 += dz, l0 += dl )
+	{
+		if (z0 >= zbuf[x]) continue;
+		const float z = 1.0f / z0;
+		const int u = (int)(u0 * z * s.tw) & s.umask, v = (int)(v0 * z * s.th) & s.vmask;
+		const uint light = (uint)(l0 * z * lightScale + lightBias), c = s.src[u + v * s.pitch];
+		const uint r = min( 255u, (((c >> 16) & 255) * light) >> 8 ), g = min( 255u, (((c >> 8) & 255) * light) >> 8 );
+		dest[x] = (r << 16) + (g << 8) + min( 255u, ((c & 255) * light) >> 8 ), zbuf[x] = z0;
+	}
 }
 
 // -----------------------------------------------------------
@@ -48,119 +605,375 @@ Mesh::Mesh( int vcount, int tcount ) : verts( vcount ), tris( tcount )
 // stages:
 // 1. mesh culling: checks the mesh against the view frustum
 // 2. vertex transform: calculates world space coordinates
-// 3. triangle rendering loop. substages:
-//    a) backface culling
-//    b) clipping (Sutherland-Hodgeman)
-//    c) shading (using pre-scaled palettes for speed)
-//    d) projection: world-space to 2D screen-space
-//    e) span construction
-//    f) span filling
+// 3. triangle rendering loop (see Mesh::Rasterize)
+// the stages are separate functions, so that the frame task
+// graph of the rasterizer can schedule them independently.
 // -----------------------------------------------------------
-void Mesh::Render( mat4& transform )
+void Mesh::Render( mat4& transform, RenderContext& context )
 {
-	// cull mesh
+	if (!IsVisible( transform, context )) return;
+	vec3* tpos = context.GetScratch( verts );
+	Transform( transform, tpos );
+	Rasterize( transform, tpos, context );
+}
+
+// -----------------------------------------------------------
+// Mesh::IsVisible
+// checks the mesh bounds against the view frustum
+// -----------------------------------------------------------
+bool Mesh::IsVisible( mat4& transform, RenderContext& context )
+{
+	const vec4* frustum = context.frustum;
 	vec3 c[8];
 	for( int i = 0; i < 8; i++ ) c[i] = (transform * vec4( bounds[i & 1].x, bounds[(i >> 1) & 1].y, bounds[i >> 2].z, 1 )).xyz;
 	for( int i, p = 0; p < 5; p++ ) 
 	{
-		for( i = 0; i < 8; i++ ) if ((dot( Rasterizer::frustum[p].xyz, c[i] ) - Rasterizer::frustum[p].w) > 0) break;
-		if (i == 8) return;
+		for( i = 0; i < 8; i++ ) if ((dot( frustum[p].xyz, c[i] ) - frustum[p].w) > 0) break;
+		if (i == 8) return false;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------
+// Mesh::Transform
+// transforms the vertices to camera space, into tpos, which
+// belongs to the caller (a render context or frame): the mesh
+// itself is not written, so that several contexts can draw it
+// at once. compressed positions are decoded by folding the
+// dequantization into the transform.
+// -----------------------------------------------------------
+void Mesh::Transform( mat4& transform, vec3* tpos )
+{
+	if (qvert)
+	{
+		mat4 D;
+		const vec3 e = (bounds[1] - bounds[0]) * (1.0f / 65535);
+		D[0] = e.x, D[5] = e.y, D[10] = e.z, D[3] = bounds[0].x, D[7] = bounds[0].y, D[11] = bounds[0].z;
+		const mat4 Q = transform * D;
+		parallel_for( 0, verts, 4096, [&]( int first, int last )
+		{
+			for( int i = first; i < last; i++ ) tpos[i] = (Q * vec4( (float)qvert[i].x, (float)qvert[i].y, (float)qvert[i].z, 1 )).xyz;
+		} );
 	}
-	// transform vertices
-	for( int i = 0; i < verts; i++ ) tpos[i] = (transform * vec4( pos[i], 1 )).xyz;
-	// draw triangles
+	else parallel_for( 0, verts, 4096, [&]( int first, int last )
+	{
+		for( int i = first; i < last; i++ ) tpos[i] = (transform * vec4( pos[i], 1 )).xyz;
+	} );
+}
+
+// -----------------------------------------------------------
+// Mesh::Bin
+// for vertices transformed by Mesh::Transform: per triangle,
+// the mask of the target bands (ZBUFFER_BANDS) its projection
+// may cover; 0 for backfacing triangles. triangles that cross
+// the near plane are assigned to all bands. the masks are
+// conservative: Rasterize clips to the rows of its band.
+// -----------------------------------------------------------
+void Mesh::Bin( mat4& transform, vec3* tpos, RenderContext& context, uchar* bins )
+{
+	const int width = context.width, height = context.height;
+	const vec4 nearPlane = context.frustum[0];
+	parallel_for( 0, tris, 4096, [&]( int first, int last )
+	{
+		for( int i = first; i < last; i++ )
+		{
+			const vec3 Nt = (transform * vec4( N[i], 0 )).xyz;
+			const vec3 A = tpos[GetIndex( i * 3 )], B = tpos[GetIndex( i * 3 + 1 )], C = tpos[GetIndex( i * 3 + 2 )];
+			if (dot( A, Nt ) > 0) { bins[i] = 0; continue; }
+			if ((dot( nearPlane.xyz, A ) < nearPlane.w) || (dot( nearPlane.xyz, B ) < nearPlane.w) || (dot( nearPlane.xyz, C ) < nearPlane.w))
+			{
+				bins[i] = (1 << ZBUFFER_BANDS) - 1;
+				continue;
+			}
+			const float ya = (A.y * width) / A.z, yb = (B.y * width) / B.z, yc = (C.y * width) / C.z;
+			const float y0 = min( ya, min( yb, yc ) ) + height / 2 - 1, y1 = max( ya, max( yb, yc ) ) + height / 2 + 1;
+			uchar mask = 0;
+			for( int b = 0; b < ZBUFFER_BANDS; b++ )
+				if ((y1 >= (b * height) / ZBUFFER_BANDS) && (y0 < ((b + 1) * height) / ZBUFFER_BANDS)) mask |= 1 << b;
+			bins[i] = mask;
+		}
+	} );
+}
+
+// -----------------------------------------------------------
+// Mesh::Rasterize
+// triangle rendering loop, for vertices transformed by
+// Mesh::Transform; with bins (see Mesh::Bin), only the rows of
+// the given band are drawn, so that bands can be drawn
+// concurrently. substages:
+// a) backface culling
+// b) clipping (Sutherland-Hodgeman)
+// c) shading (using pre-scaled palettes for speed)
+// d) projection: world-space to 2D screen-space
+// e) span construction
+// f) span filling (nearest, or bilinear for magnified
+//    triangles of materials that request it)
+// -----------------------------------------------------------
+void Mesh::Rasterize( mat4& transform, vec3* tpos, RenderContext& context, const uchar* bins, int band )
+{
 	if (!material->texture) return; // for now: texture required.
-	unsigned char* src = material->texture->pixels->GetBuffer();
-	float* zbuffer = Rasterizer::zbuffer, f;
-	const float tw = (float)material->texture->pixels->GetWidth();
-	const float th = (float)material->texture->pixels->GetHeight();
-	const int umask = (int)tw - 1, vmask = (int)th - 1;
+	Surface8* texture = material->texture->pixels;
+	const bool truecolor = (material->format == Material::TRUECOLOR) && (material->texture->rgbaLevels > 0);
+	const int width = context.width, height = context.height;
+	float* zbuffer = context.zbuffer, f;
+	float* xleft = context.xleft, *xright = context.xright, *uleft = context.uleft, *uright = context.uright;
+	float* vleft = context.vleft, *vright = context.vright, *zleft = context.zleft, *zright = context.zright;
+	float* lleft = context.lleft, *lright = context.lright;
+	Surface* screen = context.screen;
+	const float texels = (float)texture->GetWidth() * (float)texture->GetHeight();
+	const int levels = texture->GetMipLevels();
+	const int ybegin = bins ? (band * height) / ZBUFFER_BANDS : 0, yend = bins ? ((band + 1) * height) / ZBUFFER_BANDS : height;
+	const int rowFirst = max( 1, ybegin ), rowLast = min( height - 2, yend - 1 );
 	for( int i = 0; i < tris; i++ )
 	{
+		if (bins && !(bins[i] & (1 << band))) continue;
 		// cull triangle
 		vec3 Nt = (transform * vec4( N[i], 0 )).xyz;
-		if (dot( tpos[tri[i * 3 + 0]], Nt ) > 0) continue;
+		if (dot( tpos[GetIndex( i * 3 )], Nt ) > 0) continue;
 		// clip
 		vec3 cpos[2][8], *pos;
 		vec2 cuv[2][8], *tuv;
-		int nin = 3, nout = 0, from = 0, to = 1, miny = SCRHEIGHT - 1, maxy = 0, h;
-		for( int v = 0; v < 3; v++ ) cpos[0][v] = tpos[tri[i * 3 + v]], cuv[0][v] = uv[tri[i * 3 + v]];
+		float cl[2][8], *tl;
+		int nin = 3, nout = 0, from = 0, to = 1, miny = height - 1, maxy = 0, h;
+		for( int v = 0; v < 3; v++ )
+		{
+			const int idx = GetIndex( i * 3 + v );
+			cpos[0][v] = tpos[idx], cuv[0][v] = GetUV( idx );
+			cl[0][v] = truecolor ? max( 0.0f, (transform * vec4( GetNormal( idx ), 0 )).z ) : 0; // per-vertex light
+		}
 		for( int p = 0; p < 2; p++, from = 1 - from, to = 1 - to, nin = nout, nout = 0 ) for( int v = 0; v < nin; v++ )
 		{
 			const vec3 A = cpos[from][v], B = cpos[from][(v + 1) % nin];
 			const vec2 Auv = cuv[from][v], Buv = cuv[from][(v + 1) % nin];
-			const vec4 plane = Rasterizer::frustum[p];
+			const float Al = cl[from][v], Bl = cl[from][(v + 1) % nin];
+			const vec4 plane = context.frustum[p];
 			const float t1 = dot( plane.xyz, A ) - plane.w, t2 = dot( plane.xyz, B ) - plane.w;
 			if ((t1 < 0) && (t2 >= 0))
 				f = t1 / (t1 - t2),
-				cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A),
-				cuv[to][nout] = Buv, cpos[to][nout++] = B;
-			else if ((t1 >= 0) && (t2 >= 0)) cuv[to][nout] = Buv, cpos[to][nout++] = B;
+				cl[to][nout] = Al + (Bl - Al) * f, cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A),
+				cl[to][nout] = Bl, cuv[to][nout] = Buv, cpos[to][nout++] = B;
+			else if ((t1 >= 0) && (t2 >= 0)) cl[to][nout] = Bl, cuv[to][nout] = Buv, cpos[to][nout++] = B;
 			else if ((t1 >= 0) && (t2 < 0))
 				f = t1 / (t1 - t2),
-				cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A);
+				cl[to][nout] = Al + (Bl - Al) * f, cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A);
 		}
 		if (nin == 0) continue;
-		// shade
-		Pixel* pal = material->texture->pixels->GetPalette( (int)(max( 0.0f, Nt.z ) * (PALETTE_LEVELS - 1) ) );
+		// shade: palettized materials use a pre-scaled palette; truecolor
+		// materials never touch the palettes, which are built on first use
+		Pixel* pal = truecolor ? 0 : texture->GetPalette( (int)(max( 0.0f, Nt.z ) * (PALETTE_LEVELS - 1) ) );
 		// project
-		pos = cpos[from], tuv = cuv[from];
+		pos = cpos[from], tuv = cuv[from], tl = cl[from];
 		for( int v = 0; v < nin; v++ )
-			pos[v].x = ((pos[v].x * SCRWIDTH) / -pos[v].z) + SCRWIDTH / 2,
-			pos[v].y = ((pos[v].y * SCRWIDTH) / pos[v].z) + SCRHEIGHT / 2;
+			pos[v].x = ((pos[v].x * width) / -pos[v].z) + width / 2,
+			pos[v].y = ((pos[v].y * width) / pos[v].z) + height / 2;
+		// select mip level from the texel-to-pixel area ratio of the clipped polygon
+		float sarea = 0, tarea = 0;
+		for( int v = 0; v < nin; v++ )
+		{
+			const int w = (v + 1) % nin;
+			sarea += pos[v].x * pos[w].y - pos[w].x * pos[v].y;
+			tarea += tuv[v].x * tuv[w].y - tuv[w].x * tuv[v].y;
+		}
+		const float ratio = (sarea != 0) ? fabsf( tarea / sarea ) * texels : 0;
+		const int wanted = (ratio > 1) ? min( levels - 1, (int)(0.5f * log2f( ratio )) ) : 0;
+		const int level = truecolor ? min( wanted, material->texture->rgbaLevels - 1 ) : context.Request( material->texture, wanted );
+		Surface* rgba = truecolor ? material->texture->rgba[level] : 0;
+		const unsigned char* src = truecolor ? 0 : texture->GetBuffer( level );
+		const float tw = (float)(truecolor ? rgba->GetWidth() : texture->GetWidth( level ));
+		const float th = (float)(truecolor ? rgba->GetHeight() : texture->GetHeight( level ));
+		int wshift = 0;
+		while ((1 << wshift) < (int)tw) wshift++;
+		const int umask = (int)tw - 1, vmask = (int)th - 1, pitch = truecolor ? rgba->GetPitch() : (int)tw;
+		const int layout = truecolor ? Surface8::LINEAR : texture->GetLevelLayout( level );
+		const unsigned char* sub = (layout == Surface8::BLOCK4) ? texture->GetSubPalettes( level ) : 0;
+		const bool bilinear = (material->filter == Material::BILINEAR) && (level == 0);
+		const TexelSampler sampler = { src, sub, pal, tw * 256, th * 256, umask, vmask, wshift, pitch, layout };
+		const TruecolorSampler rgbaSampler = { truecolor ? rgba->GetBuffer() : 0, tw, th, umask, vmask, pitch };
 		// draw
 		for( int j = 0; j < nin; j++ )
 		{
 			int vert0 = j, vert1 = (j + 1) % nin;
 			if (pos[vert0].y > pos[vert1].y) h = vert0, vert0 = vert1, vert1 = h;
 			const float y0 = pos[vert0].y, y1 = pos[vert1].y, rydiff = 1.0f / (y1 - y0);
-			if ((y0 == y1) || (y0 >= SCRHEIGHT) || (y1 < 1)) continue;
-			const int iy0 = max( 1, (int)y0 + 1 ), iy1 = min( SCRHEIGHT - 2, (int)y1 );
+			if ((y0 == y1) || (y0 >= height) || (y1 < 1)) continue;
+			const int iy0 = max( rowFirst, (int)y0 + 1 ), iy1 = min( rowLast, (int)y1 );
 			float x0 = pos[vert0].x, dx = (pos[vert1].x - x0) * rydiff;
 			float z0 = 1.0f / pos[vert0].z, z1 = 1.0f / pos[vert1].z, dz = (z1 - z0) * rydiff;
 			float u0 = tuv[vert0].x * z0, du = (tuv[vert1].x * z1 - u0) * rydiff;
 			float v0 = tuv[vert0].y * z0, dv = (tuv[vert1].y * z1 - v0) * rydiff;
+			float l0 = tl[vert0] * z0, dl = (tl[vert1] * z1 - l0) * rydiff;
 			const float f = (float)iy0 - y0;
-			x0 += dx * f, u0 += du * f, v0 += dv * f, z0 += dz * f;
+			x0 += dx * f, u0 += du * f, v0 += dv * f, z0 += dz * f, l0 += dl * f;
 			for( int y = iy0; y <= iy1; y++ )
 			{
-				if (x0 < xleft[y]) xleft[y] = x0, uleft[y] = u0, vleft[y] = v0, zleft[y] = z0;
-				if (x0 > xright[y]) xright[y] = x0, uright[y] = u0, vright[y] = v0, zright[y] = z0;
-				x0 += dx, u0 += du, v0 += dv, z0 += dz;
+				if (x0 < xleft[y]) xleft[y] = x0, uleft[y] = u0, vleft[y] = v0, zleft[y] = z0, lleft[y] = l0;
+				if (x0 > xright[y]) xright[y] = x0, uright[y] = u0, vright[y] = v0, zright[y] = z0, lright[y] = l0;
+				x0 += dx, u0 += du, v0 += dv, z0 += dz, l0 += dl;
 			}
 			miny = min( miny, iy0 ), maxy = max( maxy, iy1 );
 		}
-		for( int y = miny; y <= maxy; xleft[y] = SCRWIDTH - 1, xright[y++] = 0 )
+		for( int y = miny; y <= maxy; xleft[y] = (float)(width - 1), xright[y++] = 0 )
 		{
 			float x0 = xleft[y], x1 = xright[y], rxdiff = 1.0f / (x1 - x0);
 			float u0 = uleft[y], du = (uright[y] - u0) * rxdiff;
 			float v0 = vleft[y], dv = (vright[y] - v0) * rxdiff;
 			float z0 = zleft[y], dz = (zright[y] - z0) * rxdiff;
-			const int ix0 = (int)x0 + 1, ix1 = min( SCRWIDTH - 2, (int)x1 );
+			float l0 = lleft[y], dl = (lright[y] - l0) * rxdiff;
+			const int ix0 = (int)x0 + 1, ix1 = min( width - 2, (int)x1 );
 			const float f = (float)ix0 - x0;
-			u0 += f * du, v0 += f * dv, z0 += f * dz;
+			u0 += f * du, v0 += f * dv, z0 += f * dz, l0 += f * dl;
 			Pixel* dest = screen->GetBuffer() + y * screen->GetWidth();
-			float* zbuf = zbuffer + y * SCRWIDTH;
-			for( int x = ix0; x <= ix1; x++, u0 += du, v0 += dv, z0 += dz ) // plot span
+			float* zbuf = zbuffer + y * width;
+			if (truecolor) TruecolorSpan( dest, zbuf, ix0, ix1, u0, v0, z0, l0, du, dv, dz, dl, rgbaSampler );
+			else if (bilinear) BilinearSpan( dest, zbuf, ix0, ix1, u0, v0, z0, du, dv, dz, sampler );
+			else if (layout == Surface8::BLOCK4) for( int x = ix0; x <= ix1; x++, u0 += du, v0 += dv, z0 += dz ) // plot span, 4-bit blocks
+			{
+				if (z0 >= zbuf[x]) continue;
+				const float z = 1.0f / z0;
+				const int u = (int)(u0 * z * tw) & umask, v = (int)(v0 * z * th) & vmask;
+				dest[x] = pal[Surface8::Block4Index( src, sub, Surface8::TiledAddress( u, v, wshift ) )], zbuf[x] = z0;
+			}
+			else if (layout == Surface8::TILED) for( int x = ix0; x <= ix1; x++, u0 += du, v0 += dv, z0 += dz ) // plot span, 8x8 tiles
+			{
+				if (z0 >= zbuf[x]) continue;
+				const float z = 1.0f / z0;
+				const int u = (int)(u0 * z * tw) & umask, v = (int)(v0 * z * th) & vmask;
+				dest[x] = pal[src[Surface8::TiledAddress( u, v, wshift )]], zbuf[x] = z0;
+			}
+			else for( int x = ix0; x <= ix1; x++, u0 += du, v0 += dv, z0 += dz ) // plot span, linear
 			{
 				if (z0 >= zbuf[x]) continue;
 				const float z = 1.0f / z0;
 				const int u = (int)(u0 * z * tw) & umask, v = (int)(v0 * z * th) & vmask;
-				dest[x] = pal[src[u + v * (umask + 1)]], zbuf[x] = z0;
+				dest[x] = pal[src[u + v * pitch]], zbuf[x] = z0;
 			}
 		}
 	}
 }
 
+// -----------------------------------------------------------
+// LoadReport::Print
+// writes load statistics to the console
+// -----------------------------------------------------------
+void LoadReport::Print()
+{
+	printf( "loaded %i meshes, %i vertices, %i triangles in %.1fms\n", meshes, verts, tris, loadTime );
+	printf( "merged into %i meshes\n", batches );
+	printf( "geometry: %.1fMB, stored as %.1fMB; scene arena: %.1fMB\n", rawBytes / 1048576.0f, storedBytes / 1048576.0f, arenaBytes / 1048576.0f );
+	printf( "textures: %i loaded, %i duplicates shared, %.1fMB saved\n", textures, sharedTextures, sharedBytes / 1048576.0f );
+	printf( "palettes: %i unique sets in use, %.1fMB; sets are generated when a texture is first drawn\n",
+		PalettePool::GetSets(), PalettePool::GetBytes() / 1048576.0f );
+	printf( "vertex cache (%i): ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", VCACHE_SIZE,
+		ACMR( missesBefore ), ACMR( missesAfter ), ATVR( missesBefore ), ATVR( missesAfter ) );
+}
+
 // -----------------------------------------------------------
 // Scene destructor
 // -----------------------------------------------------------
 Scene::~Scene()
 {
+	// nodes, meshes, materials and names are released with the arena;
+	// textures live there too, but their texels do not
 	delete root;
-	for( uint i = 0; i < texList.size(); i++ ) delete texList[i];
-	for( uint i = 0; i < matList.size(); i++ ) delete matList[i];
-	delete scenePath;
+	for( uint i = 0; i < texList.size(); i++ ) texList[i]->~Texture();
+}
+
+// -----------------------------------------------------------
+// TextureResidency::BeginFrame / EndFrame
+// bracket a frame that draws the scene. drawing counts the
+// frames in flight; the frame that takes it from 1 to -1 is
+// the last one, and updates the resident levels before it
+// returns to 0. frames that begin meanwhile wait: they would
+// sample levels that are being released.
+// -----------------------------------------------------------
+void TextureResidency::BeginFrame()
+{
+	if (!budget) return;
+	int count = drawing.load();
+	while ((count < 0) || !drawing.compare_exchange_weak( count, count + 1 ))
+		if (count < 0) std::this_thread::yield(), count = drawing.load();
+}
+
+void TextureResidency::EndFrame( vector<Texture*>& list, RenderContext& context )
+{
+	if (!budget) return;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		if (pending.size() < list.size()) pending.resize( list.size(), MAX_MIPS );
+		for( uint i = 0; i < list.size(); i++ ) pending[i] = min( pending[i], context.TakeRequest( i ) );
+	}
+	int count = drawing.load();
+	while (!drawing.compare_exchange_weak( count, (count == 1) ? -1 : (count - 1) ));
+	if (count > 1) return; // other frames still draw; the last one to end updates
+	Update( list );
+	drawing.store( 0 );
+}
+
+// -----------------------------------------------------------
+// TextureResidency::Update
+// called by the last frame to end, when no frame draws the
+// scene. takes the mip levels the frames requested, then
+// streams in missing levels, textures with the largest
+// shortfall (resident level minus requested level) first,
+// until the per-update rate is reached. to stay within budget,
+// levels that are finer than needed are evicted, least
+// recently used textures first; levels requested for this
+// update are never evicted.
+// -----------------------------------------------------------
+void TextureResidency::Update( vector<Texture*>& list )
+{
+	frame++, resident = PalettePool::GetBytes();
+	vector<Texture*> need;
+	for( uint i = 0; i < list.size(); i++ )
+	{
+		Texture* t = list[i];
+		const int level = pending[i];
+		pending[i] = MAX_MIPS;
+		if (level < MAX_MIPS) t->wanted = level, t->lastUsed = frame;
+		if (t->lastUsed == frame && t->wanted < t->pixels->GetResidentLevel()) need.push_back( t );
+		resident += t->pixels->GetResidentBytes();
+	}
+	if (resident > budget) Evict( list, resident - budget ); // e.g. after the budget was lowered
+	// largest shortfall first: those textures are sampled furthest from the requested level
+	sort( need.begin(), need.end(), []( Texture* a, Texture* b ) {
+		return (a->pixels->GetResidentLevel() - a->wanted) > (b->pixels->GetResidentLevel() - b->wanted); } );
+	int loaded = 0;
+	for( uint i = 0; i < need.size() && loaded < rate; i++ )
+	{
+		Surface8* s = need[i]->pixels;
+		while ((need[i]->wanted < s->GetResidentLevel()) && (loaded < rate))
+		{
+			// a level that does not fit may still leave room for the smaller levels of the next textures
+			const int size = s->GetLevelBytes( s->GetResidentLevel() - 1 );
+			if ((resident + size > budget) && !Evict( list, resident + size - budget )) break;
+			if (!s->StreamIn()) break;
+			resident += size, loaded += size, streamed += size;
+		}
+	}
+}
+
+// -----------------------------------------------------------
+// TextureResidency::Evict
+// releases at least 'bytes' of texture memory that is not
+// needed for the current frame; returns false if that is not
+// possible.
+// -----------------------------------------------------------
+bool TextureResidency::Evict( vector<Texture*>& list, int64 bytes )
+{
+	vector<Texture*> lru;
+	for( uint i = 0; i < list.size(); i++ ) if (list[i]->pixels->IsStreamed()) lru.push_back( list[i] );
+	sort( lru.begin(), lru.end(), []( Texture* a, Texture* b ) { return a->lastUsed < b->lastUsed; } );
+	for( uint i = 0; i < lru.size() && bytes > 0; i++ )
+	{
+		Surface8* s = lru[i]->pixels;
+		const int needed = (lru[i]->lastUsed == frame) ? lru[i]->wanted : s->GetTailLevel();
+		while ((s->GetResidentLevel() < needed) && (bytes > 0))
+		{
+			const int size = s->GetLevelBytes( s->GetResidentLevel() );
+			s->Evict(), resident -= size, bytes -= size, evicted += size;
+		}
+	}
+	return bytes <= 0;
 }
 
 // -----------------------------------------------------------
@@ -175,9 +988,20 @@ void Scene::ExtractPath( const char* file )
 	while (strstr( lastSlash, "/" )) lastSlash = strstr( lastSlash, "/" ) + 1;
 	while (strstr( lastSlash, "\\" )) lastSlash = strstr( lastSlash, "\\" ) + 1;
 	*lastSlash = 0;
-	delete scenePath;
-	scenePath = new char[strlen( tmp ) + 1];
-	strcpy( scenePath, tmp );
+	scenePath = arena.StrDup( tmp );
+}
+
+// -----------------------------------------------------------
+// Scene::Intern
+// returns the unique copy of a name, stored in the scene arena
+// -----------------------------------------------------------
+char* Scene::Intern( const char* name )
+{
+	auto it = names.find( (char*)name );
+	if (it != names.end()) return *it;
+	char* interned = arena.StrDup( name );
+	names.insert( interned );
+	return interned;
 }
 
 // -----------------------------------------------------------
@@ -186,9 +1010,10 @@ void Scene::ExtractPath( const char* file )
 // -----------------------------------------------------------
 Material* Scene::FindMaterial( const char* name )
 {
-	for( uint s = matList.size(), i = 0; i < s; i++ ) if (matList[i]->name) 
-		if (!strcmp( matList[i]->name, name )) return matList[i];
-	return 0;
+	auto n = names.find( (char*)name );
+	if (n == names.end()) return 0;
+	auto it = matIndex.find( *n );
+	return (it == matIndex.end()) ? 0 : it->second;
 }
 
 // -----------------------------------------------------------
@@ -197,9 +1022,37 @@ Material* Scene::FindMaterial( const char* name )
 // -----------------------------------------------------------
 Texture* Scene::FindTexture( const char* name )
 {
-	for( uint s = texList.size(), i = 0; i < s; i++ ) if (texList[i]->name)
-		if (!strcmp( texList[i]->name, name )) return texList[i];
-	return 0;
+	auto n = names.find( (char*)name );
+	if (n == names.end()) return 0;
+	auto it = texIndex.find( *n );
+	return (it == texIndex.end()) ? 0 : it->second;
+}
+
+// -----------------------------------------------------------
+// Scene::LoadTexture
+// loads a texture file; if an earlier texture has the same
+// content, the new one is discarded and the earlier one is
+// returned, so that duplicates under different file names
+// share a single Texture.
+// -----------------------------------------------------------
+Texture* Scene::LoadTexture( char* file )
+{
+	Surface8* pixels = new Surface8( file, residency.budget > 0 );
+	const uint64 hash = pixels->ContentHash();
+	report.textures++;
+	auto range = texContent.equal_range( hash );
+	for( auto it = range.first; it != range.second; ++it ) if (it->second->pixels->SameContent( pixels ))
+	{
+		report.sharedTextures++, report.sharedBytes += pixels->GetResidentBytes();
+		delete pixels;
+		return it->second;
+	}
+	Texture* texture = new (arena) Texture();
+	texture->pixels = pixels, texture->index = (int)texList.size();
+	texture->name = Intern( file );
+	texList.push_back( texture );
+	texContent.insert( make_pair( hash, texture ) );
+	return texture;
 }
 
 // -----------------------------------------------------------
@@ -226,8 +1079,18 @@ void Scene::LoadMTL( const char* file )
 		if (!_stricmp( cmd, "newmtl" ))
 		{
 			sscanf( line + strlen( cmd ), "%s", matName );
-			matList.push_back( current = new Material() );
-			current->SetName( matName );
+			matList.push_back( current = new (arena) Material() );
+			current->name = Intern( matName );
+			if (!matIndex.count( current->name )) matIndex[current->name] = current;
+		#ifdef BILINEAR_TEXTURES
+			current->filter = Material::BILINEAR;
+		#endif
+		}
+		if (!_stricmp( cmd, "filter" ) && current) // non-standard: 'filter bilinear' or 'filter nearest'
+		{
+			char mode[32] = "";
+			sscanf( line + strlen( cmd ), "%31s", mode );
+			current->filter = _stricmp( mode, "bilinear" ) ? Material::NEAREST : Material::BILINEAR;
 		}
 		if (_stricmp( cmd, "map_Kd" )) continue;
 		char* tname = strstr( line, " " );
@@ -236,8 +1099,11 @@ void Scene::LoadMTL( const char* file )
 		strcat( fname, "textures/" );
 		strcat( fname, tname );
 		Texture* texture = FindTexture( fname );
-		if (!texture) texList.push_back( texture = new Texture( fname ) );
+		if (!texture) texIndex[Intern( fname )] = texture = LoadTexture( fname );
 		current->texture = texture;
+	#ifdef TRUECOLOR_TEXTURES
+		current->SetFormat( Material::TRUECOLOR );
+	#endif
 	}
 	fclose( f );
 }
@@ -257,7 +1123,9 @@ SGNode* Scene::LoadOBJ( const char* file, const float _Scale )
 		UniqueVertex( int v, int n = -1, int t = -1 ) : vertex( v ), normal( n ), uv( t ), next( -1 ), subid( 0 ) {}
 		int vertex, normal, uv, next, subid, idx;
 	};
-	SGNode* root = new SGNode(), *group = root;
+	timer t;
+	Arena scratch; // load-time mesh data; final meshes are relocated to the scene arena
+	SGNode* root = new (arena) SGNode( &arena ), *group = root;
 	Mesh* current = 0, *nextMesh = 0;
 	FILE* f = fopen( file, "r" );
 	ExtractPath( file );
@@ -290,7 +1158,8 @@ SGNode* Scene::LoadOBJ( const char* file, const float _Scale )
 				{
 					// prepare new mesh
 					sscanf( line + 7, "%s", tmp );
-					nextMesh = new Mesh();
+					nextMesh = new (arena) Mesh( &arena );
+					nextMesh->store = &scratch;
 					nextMesh->material = FindMaterial( tmp );
 					group->child.push_back( nextMesh );
 					subID++;
@@ -301,7 +1170,7 @@ SGNode* Scene::LoadOBJ( const char* file, const float _Scale )
 					formata = -1;
 					char* g = line + 2;
 					while ((g[0]) && (g[strlen( g ) - 1] < 33)) g[strlen( g ) - 1] = 0;
-					root->child.push_back( group = new SGNode() );
+					root->child.push_back( group = new (arena) SGNode( &arena ) );
 				}
 				if (line[0] == 'v') if (line[1] == ' ' ) 
 				{ 
@@ -367,48 +1236,184 @@ SGNode* Scene::LoadOBJ( const char* file, const float _Scale )
 				}
 			}
 			// create mesh
-			int nv = current->verts = vlist_.size(), nt = current->tris = index_.size() / 3;
-			current->pos = new vec3[nv * 3], current->tpos = current->pos + nv;
-			current->norm = current->pos + 2 * nv, current->spos = new vec2[nv * 2];
-			current->N = new vec3[nt], current->uv = current->spos + nv;
-			current->tri = new int[nt * 3];
+			int nv = vlist_.size(), nt = index_.size() / 3;
+			current->Allocate( nv, nt );
 			memcpy( current->pos, (vec3*)&vlist_[0], current->verts * sizeof( vec3 ) );
 			memcpy( current->uv, (vec2*)&uvlist_[0], current->verts * sizeof( vec2 ) );
 			memcpy( current->tri, (int*)&index_[0], current->tris * 3 * sizeof( int ) );
 			memcpy( current->norm, (vec3*)&nlist_[0], current->verts * sizeof( vec3 ) );
 			// calculate triangle planes
-			for( int i = 0; i < current->tris; i++ )
+			parallel_for( 0, current->tris, 4096, [&]( int first, int last )
 			{
-				vec3 v0 = vlist_[index_[i * 3 + 0]], v1 = vlist_[index_[i * 3 + 1]], v2 = vlist_[index_[i * 3 + 2]];
-				current->N[i] = normalize( cross( v1 - v0, v2 - v0 ) );
-				if (dot( current->N[i], nlist_[index_[i * 3 + 1]] ) < 0) current->N[i] *= -1.0f;
-			}
+				for( int i = first; i < last; i++ )
+				{
+					vec3 v0 = vlist_[index_[i * 3 + 0]], v1 = vlist_[index_[i * 3 + 1]], v2 = vlist_[index_[i * 3 + 2]];
+					current->N[i] = normalize( cross( v1 - v0, v2 - v0 ) );
+					if (dot( current->N[i], nlist_[index_[i * 3 + 1]] ) < 0) current->N[i] *= -1.0f;
+				}
+			} );
 			// calculate mesh bounds
-			vec3& bmin = current->bounds[0], &bmax = current->bounds[1];
-			bmin = { 1e30f, 1e30f, 1e30f }, bmax = { -1e30f, -1e30f, -1e30f };
-			for( int i = 0; i < current->verts; i++ )
-				bmin.x = min( bmin.x, current->pos[i].x ), bmax.x = max( bmax.x, current->pos[i].x ),
-				bmin.y = min( bmin.y, current->pos[i].y ), bmax.y = max( bmax.y, current->pos[i].y ),
-				bmin.z = min( bmin.z, current->pos[i].z ), bmax.z = max( bmax.z, current->pos[i].z );
+			current->UpdateBounds();
+			report.meshes++, report.verts += nv, report.tris += nt;
 			// clean up
 			while (unique.size() > vlist.size()) unique.pop_back();
 			index.clear();
 		}
 		fclose( f );
 	}
+	// post-load optimization
+	if (batchTris > 0) MergeMeshes( root );
+	OptimizeMeshes( root );
+	report.arenaBytes = arena.Used();
+	report.loadTime += t.elapsed();
+#ifdef VERBOSE
+	report.Print();
+#endif
 	return root;
 }
 
+// -----------------------------------------------------------
+// Scene::MergeMeshes
+// post-load optimization: the OBJ loader produces a mesh per
+// usemtl per group, which for large scenes means thousands of
+// tiny meshes, each paying for a matrix multiply, a cull test
+// and setup. this merges static meshes (no transform on the
+// path from 'node') that share a material into batches of at
+// most batchTris triangles. batches are formed by splitting
+// the meshes spatially, so that they remain compact for
+// frustum culling; nodes with a transform are left alone.
+// -----------------------------------------------------------
+static bool IsIdentity( mat4& M ) { mat4 I; return !memcmp( M.cell, I.cell, sizeof( I.cell ) ); }
+static void CollectStatic( SGNode* node, vector<Mesh*>& meshes, vector<SGNode*>& other )
+{
+	for( uint i = 0; i < node->child.size(); i++ )
+	{
+		SGNode* c = node->child[i];
+		if (!IsIdentity( c->localTransform )) { other.push_back( c ); continue; }
+		CollectStatic( c, meshes, other );
+		if (c->GetType() != SGNode::SG_MESH) SGNode::Destroy( c );
+		else if (((Mesh*)c)->qvert) other.push_back( c ); // already compressed; leave as is
+		else meshes.push_back( (Mesh*)c );
+	}
+	node->child.clear();
+}
+void Scene::MergeMeshes( SGNode* node )
+{
+	vector<Mesh*> meshes;
+	vector<SGNode*> other;
+	CollectStatic( node, meshes, other );
+	// make the meshes of each material a contiguous range
+	stable_sort( meshes.begin(), meshes.end(), []( Mesh* a, Mesh* b ) { return a->material < b->material; } );
+	for( uint first = 0, last; first < meshes.size(); first = last )
+	{
+		for( last = first + 1; last < meshes.size(); last++ ) if (meshes[last]->material != meshes[first]->material) break;
+		BatchMeshes( &meshes[first], last - first, node );
+	}
+	for( uint i = 0; i < other.size(); i++ ) node->Add( other[i] );
+}
+
+// -----------------------------------------------------------
+// Scene::BatchMeshes
+// recursively splits a list of meshes (sharing a material)
+// along the longest axis of their centers until each part
+// fits in a batch; the parts are merged and added to parent
+// -----------------------------------------------------------
+void Scene::BatchMeshes( Mesh** list, int count, SGNode* parent )
+{
+	int total = 0;
+	for( int i = 0; i < count; i++ ) total += list[i]->tris;
+	if ((count == 1) || (total <= batchTris))
+	{
+		parent->Add( (count == 1) ? list[0] : MergeBatch( list, count ) );
+		return;
+	}
+	vec3 cmin( 1e30f ), cmax( -1e30f );
+	for( int i = 0; i < count; i++ )
+	{
+		const vec3 c = (list[i]->bounds[0] + list[i]->bounds[1]) * 0.5f;
+		cmin.x = min( cmin.x, c.x ), cmax.x = max( cmax.x, c.x );
+		cmin.y = min( cmin.y, c.y ), cmax.y = max( cmax.y, c.y );
+		cmin.z = min( cmin.z, c.z ), cmax.z = max( cmax.z, c.z );
+	}
+	const vec3 e = cmax - cmin;
+	const uint axis = (e.x > e.y && e.x > e.z) ? 0 : ((e.y > e.z) ? 1 : 2);
+	sort( list, list + count, [axis]( Mesh* a, Mesh* b ) 
+		{ return (a->bounds[0][axis] + a->bounds[1][axis]) < (b->bounds[0][axis] + b->bounds[1][axis]); } );
+	// split where half of the triangles are on either side
+	int split = 0, half = 0;
+	while (half * 2 < total) half += list[split++]->tris;
+	split = max( 1, min( count - 1, split ) );
+	BatchMeshes( list, split, parent );
+	BatchMeshes( list + split, count - split, parent );
+}
+
+// -----------------------------------------------------------
+// Scene::MergeBatch
+// concatenates the geometry of a list of meshes into a new
+// mesh; the source meshes are deleted
+// -----------------------------------------------------------
+Mesh* Scene::MergeBatch( Mesh** list, int count )
+{
+	int nv = 0, nt = 0;
+	for( int i = 0; i < count; i++ ) nv += list[i]->verts, nt += list[i]->tris;
+	Mesh* first = list[0];
+	Mesh* batch = first->arena ? new (*first->arena) Mesh( first->arena ) : new Mesh();
+	batch->store = first->store;
+	batch->Allocate( nv, nt );
+	batch->material = first->material;
+	for( int i = 0, v = 0, t = 0; i < count; i++ )
+	{
+		Mesh* m = list[i];
+		memcpy( batch->pos + v, m->pos, m->verts * sizeof( vec3 ) );
+		memcpy( batch->norm + v, m->norm, m->verts * sizeof( vec3 ) );
+		memcpy( batch->uv + v, m->uv, m->verts * sizeof( vec2 ) );
+		memcpy( batch->N + t, m->N, m->tris * sizeof( vec3 ) );
+		for( int j = 0; j < m->tris * 3; j++ ) batch->tri[t * 3 + j] = m->tri[j] + v;
+		v += m->verts, t += m->tris;
+		SGNode::Destroy( m );
+	}
+	batch->UpdateBounds();
+	return batch;
+}
+
+// -----------------------------------------------------------
+// Scene::OptimizeMeshes
+// applies per-mesh optimizations to the final meshes of a
+// freshly loaded scene graph and gathers their statistics;
+// vertex cache misses are simulated on each mesh right before
+// and after reordering
+// -----------------------------------------------------------
+void Scene::OptimizeMeshes( SGNode* node )
+{
+	if (node->GetType() == SGNode::SG_MESH)
+	{
+		Mesh* mesh = (Mesh*)node;
+		report.missesBefore += mesh->CacheMisses();
+	#ifdef OPTIMIZE_MESHES
+		mesh->Optimize();
+	#endif
+		report.missesAfter += mesh->CacheMisses();
+		report.rawBytes += mesh->MemoryUsage();
+	#ifdef COMPRESS_MESHES
+		mesh->Compress();
+	#endif
+		report.storedBytes += mesh->MemoryUsage();
+		if (mesh->arena == &arena) mesh->Relocate( &arena ); // one contiguous block per mesh
+		report.batches++;
+	}
+	for( uint i = 0; i < node->child.size(); i++ ) OptimizeMeshes( node->child[i] );
+}
+
 // -----------------------------------------------------------
 // SGNode::Render
 // recursive rendering of a scene graph node and its child nodes
 // input: (inverse) camera transform
 // -----------------------------------------------------------
-void SGNode::Render( mat4& transform )
+void SGNode::Render( mat4& transform, RenderContext& context )
 {
 	mat4 M = transform * localTransform;
-	if (GetType() == SG_MESH) ((Mesh*)this)->Render( M );
-	for( uint i = 0; i < child.size(); i++ ) child[i]->Render( M );
+	if (GetType() == SG_MESH) ((Mesh*)this)->Render( M, context );
+	for( uint i = 0; i < child.size(); i++ ) child[i]->Render( M, context );
 }
 
 // -----------------------------------------------------------
@@ -428,38 +1433,124 @@ void SGNode::RotateABC( float a, float b, float c, int a1, int a2, int a3 )
 // -----------------------------------------------------------
 void Rasterizer::Init( Surface* screen )
 {
-	// setup outline tables & zbuffer
-	Mesh::xleft = new float[SCRHEIGHT], Mesh::xright = new float[SCRHEIGHT];
-	Mesh::uleft = new float[SCRHEIGHT], Mesh::uright = new float[SCRHEIGHT];
-	Mesh::vleft = new float[SCRHEIGHT], Mesh::vright = new float[SCRHEIGHT];
-	Mesh::zleft = new float[SCRHEIGHT], Mesh::zright = new float[SCRHEIGHT];
-	for( int y = 0; y < SCRHEIGHT; y++ ) Mesh::xleft[y] = SCRWIDTH - 1, Mesh::xright[y] = 0;
-	zbuffer = new float[SCRWIDTH * SCRHEIGHT];
-	// calculate view frustum planes
-	float C = -1.0f, x1 = 0.5f, x2 = SCRWIDTH - 1.5f, y1 = 0.5f, y2 = SCRHEIGHT - 1.5f;
-	vec3 p0 = { 0, 0, 0 };
-	vec3 p1 = { ((x1 - SCRWIDTH / 2) * C) / SCRWIDTH, ((y1 - SCRHEIGHT / 2) * C) / SCRWIDTH, 1.0f };
-	vec3 p2 = { ((x2 - SCRWIDTH / 2) * C) / SCRWIDTH, ((y1 - SCRHEIGHT / 2) * C) / SCRWIDTH, 1.0f };
-	vec3 p3 = { ((x2 - SCRWIDTH / 2) * C) / SCRWIDTH, ((y2 - SCRHEIGHT / 2) * C) / SCRWIDTH, 1.0f };
-	vec3 p4 = { ((x1 - SCRWIDTH / 2) * C) / SCRWIDTH, ((y2 - SCRHEIGHT / 2) * C) / SCRWIDTH, 1.0f };
-	frustum[0] = { 0, 0, -1, 0.2f };
-	frustum[1] = vec4( normalize( cross( p1 - p0, p4 - p1 ) ), 0 ); // left plane
-	frustum[2] = vec4( normalize( cross( p2 - p0, p1 - p2 ) ), 0 ); // top plane
-	frustum[3] = vec4( normalize( cross( p3 - p0, p2 - p3 ) ), 0 ); // right plane
-	frustum[4] = vec4( normalize( cross( p4 - p0, p3 - p4 ) ), 0 ); // bottom plane
-	// store screen pointer
-	Mesh::screen = screen;
+	// setup zbuffer, outline tables and view frustum for the target
+	delete context;
+	context = new RenderContext( screen );
 	// initialize scene
 	(scene = new Scene())->root = new SGNode();
 }
 
+// meshes of a scene graph, in rendering order
+static void Gather( SGNode* node, vector<RenderItem>& list )
+{
+	if (node->GetType() == SGNode::SG_MESH)
+	{
+		RenderItem item;
+		item.mesh = (Mesh*)node, item.tpos = 0, item.bins = 0, item.visible = false;
+		list.push_back( item );
+	}
+	for( uint i = 0; i < node->child.size(); i++ ) Gather( node->child[i], list );
+}
+
+static void CountMeshes( SGNode* node, int& count )
+{
+	if (node->GetType() == SGNode::SG_MESH) count++;
+	for( uint i = 0; i < node->child.size(); i++ ) CountMeshes( node->child[i], count );
+}
+
 // -----------------------------------------------------------
 // Rasterizer::Render
-// render the scene
+// clear the target and render the scene
 // input: camera to render with
 // -----------------------------------------------------------
 void Rasterizer::Render( Camera& camera )
 {
-	memset( zbuffer, 0, SCRWIDTH * SCRHEIGHT * sizeof( float ) );
-	scene->root->Render( inverse( camera.transform ) );
+	int meshes = 0;
+	CountMeshes( scene->root, meshes );
+	if ((graphRoot != scene->root) || (meshes != (int)items.size())) BuildFrameGraph();
+	view = inverse( camera.transform );
+	context->PrepareRequests( (int)scene->texList.size() );
+	scene->residency.BeginFrame();
+	frame.Run();
+}
+
+// -----------------------------------------------------------
+// Rasterizer::BuildFrameGraph
+// declares the stages of a frame and their dependencies:
+// - cull: scene graph traversal, mesh transforms, frustum test
+// - clear: depth and target bands, independent of everything
+//   else
+// - transform: vertex transform and band binning, per mesh,
+//   after cull
+// - raster: per mesh and band, after the transform of the mesh
+//   and the previous task of the band; within a band, meshes
+//   are drawn one at a time, in scene graph order
+// - resolve: end of the frame for texture residency, after the
+//   last mesh of every band
+// the clear and raster tasks of band b run on worker b, so
+// that the rows of a band stay in the cache (and on the NUMA
+// node) of one core from frame to frame.
+// the graph only depends on the scene graph structure, and is
+// reused every frame.
+// -----------------------------------------------------------
+void Rasterizer::BuildFrameGraph()
+{
+	frame.Clear();
+	items.clear();
+	Gather( scene->root, items );
+	int scratchVerts = 0, binTris = 0;
+	for( uint i = 0; i < items.size(); i++ ) scratchVerts += items[i].mesh->verts, binTris += items[i].mesh->tris;
+	FREE64( scratch );
+	FREE64( bins );
+	scratch = scratchVerts ? (vec3*)MALLOC64( scratchVerts * sizeof( vec3 ) ) : 0;
+	bins = binTris ? (uchar*)MALLOC64( binTris ) : 0;
+	for( uint i = 0, v = 0, t = 0; i < items.size(); v += items[i].mesh->verts, t += items[i++].mesh->tris )
+		items[i].tpos = scratch + v, items[i].bins = bins + t;
+	RenderContext* rc = context;
+	const int cull = frame.Add( "cull", [this]() { int item = 0; Cull( scene->root, view, item ); } );
+	int last[ZBUFFER_BANDS];
+	for( int b = 0; b < ZBUFFER_BANDS; b++ ) last[b] = frame.Add( "clear", [rc, b]()
+	{
+		rc->Clear( (b * rc->height) / ZBUFFER_BANDS, ((b + 1) * rc->height) / ZBUFFER_BANDS );
+	}, b );
+	for( uint i = 0; i < items.size(); i++ )
+	{
+		RenderItem* item = &items[i];
+		const int transform = frame.Add( "transform", [item, rc]()
+		{
+			if (!item->visible) return;
+			item->mesh->Transform( item->transform, item->tpos );
+			item->mesh->Bin( item->transform, item->tpos, *rc, item->bins );
+		} );
+		frame.Depend( transform, cull );
+		for( int b = 0; b < ZBUFFER_BANDS; b++ )
+		{
+			const int raster = frame.Add( "raster", [item, rc, b]()
+			{
+				if (item->visible) item->mesh->Rasterize( item->transform, item->tpos, *rc, item->bins, b );
+			}, b );
+			frame.Depend( raster, transform );
+			frame.Depend( raster, last[b] );
+			last[b] = raster;
+		}
+	}
+	const int resolve = frame.Add( "resolve", [this]() { scene->residency.EndFrame( scene->texList, *context ); } );
+	for( int b = 0; b < ZBUFFER_BANDS; b++ ) frame.Depend( resolve, last[b] );
+	frame.Depend( resolve, cull );
+	graphRoot = scene->root;
+}
+
+// -----------------------------------------------------------
+// Rasterizer::Cull
+// cull stage: walks the scene graph in the order of Gather
+// -----------------------------------------------------------
+void Rasterizer::Cull( SGNode* node, mat4& transform, int& item )
+{
+	mat4 M = transform * node->localTransform;
+	if (node->GetType() == SGNode::SG_MESH)
+	{
+		RenderItem& r = items[item++];
+		r.transform = M, r.visible = r.mesh->IsVisible( M, *context );
+	}
+	for( uint i = 0; i < node->child.size(); i++ ) Cull( node->child[i], M, item );
 }
\ No newline at end of file
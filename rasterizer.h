@@ -2,6 +2,10 @@
 
 namespace Tmpl8 {
 
+#define VCACHE_SIZE		32		// simulated post-transform cache size for mesh optimization
+#define BATCH_TRIS		8192	// default triangle budget for merged mesh batches
+#define ZBUFFER_BANDS	8		// horizontal bands of the target, cleared and drawn on worker b (max 8)
+
 // -----------------------------------------------------------
 // Texture class
 // encapsulates a palettized pixel surface with pre-scaled
@@ -11,15 +15,19 @@ class Texture
 {
 public:
 	// constructor / destructor
-	Texture() : name( 0 ) {}
-	Texture( char* file );
+	Texture() : name( 0 ), pixels( 0 ), index( -1 ), wanted( MAX_MIPS ), lastUsed( 0 ), rgbaLevels( 0 ) {}
 	~Texture();
 	// methods
-	void SetName( const char* name );
-	void Load( const char* file );
+	void LoadTruecolor();
+	void BuildTruecolor( Surface* level0 );
+	void UnloadTruecolor();
 	// data members
-	char* name;
+	char* name;						// source file; not owned (interned by the scene)
 	Surface8* pixels;
+	int index;						// position in the texture list of the scene, or -1
+	int wanted, lastUsed;			// residency: finest requested level, and the update it was requested for
+	Surface* rgba[MAX_MIPS];		// truecolor mip chain, for TRUECOLOR materials
+	int rgbaLevels;
 };
 
 // -----------------------------------------------------------
@@ -29,21 +37,66 @@ public:
 class Material
 {
 public:
+	enum { NEAREST = 0, BILINEAR = 1 };
+	enum { PALETTIZED = 0, TRUECOLOR = 1 };
 	// constructor / destructor
-	Material() : texture( 0 ), name( 0 ) {}
-	~Material();
+	Material() : texture( 0 ), name( 0 ), filter( NEAREST ), format( PALETTIZED ) {}
 	// methods
-	void SetName( char* name );
+	void SetFormat( int format );
 	// data members
 	uint diffuse;					// diffuse material color
 	Texture* texture;				// texture
-	char* name;						// material name
+	char* name;						// material name; not owned (interned by the scene)
+	int filter;						// texture filter for magnified triangles: NEAREST or BILINEAR
+	int format;						// PALETTIZED: 8-bit texels, flat shading with pre-scaled palettes;
+									// TRUECOLOR: 32-bit texels, per-vertex lighting
+};
+
+// -----------------------------------------------------------
+// RenderContext class
+// rasterization state of a view: target surface, zbuffer,
+// view frustum, outline tables, the scratch buffer for
+// transformed vertices and the mip levels requested while
+// drawing. a context is used by one frame at a time, whose
+// bands draw disjoint rows of it concurrently; separate
+// contexts can render concurrently, at their own resolution:
+// drawing writes no state of the shared meshes and textures.
+// -----------------------------------------------------------
+class RenderContext
+{
+public:
+	RenderContext( Surface* target );
+	~RenderContext();
+	vec3* GetScratch( int verts );
+	void PrepareRequests( int textures );
+	int Request( Texture* texture, int level );
+	int TakeRequest( int texture ) { return (texture < requestSlots) ? requests[texture].exchange( MAX_MIPS ) : MAX_MIPS; }
+	void ClearDepth( int y0, int y1 ) { memset( zbuffer + y0 * width, 0, (y1 - y0) * width * sizeof( float ) ); }
+	void Clear( int y0, int y1 );	// depth and target rows [y0, y1); the target is cleared to black
+	Surface* screen;
+	int width, height;
+	float* zbuffer;
+	vec4 frustum[5];
+	float* xleft, *xright;			// outline tables for rasterization
+	float* uleft, *uright;
+	float* vleft, *vright;
+	float* zleft, *zright;
+	float* lleft, *lright;
+private:
+	RenderContext( const RenderContext& );
+	vec3* tscratch;					// camera-space positions, for Mesh::Render
+	int tscratchSize;
+	std::atomic<int>* requests;		// per texture of the scene: finest mip level wanted since the last residency update
+	int requestSlots;
 };
 
 // -----------------------------------------------------------
 // SGNode class
 // scene graph node, with convenience functions for translate
 // and transform; base class for Mesh
+// nodes may live in an arena (see Scene); such nodes are not
+// deleted by their parent: their storage is released with the
+// arena. use SGNode::Destroy to remove a node of either kind.
 // -----------------------------------------------------------
 class SGNode
 {
@@ -54,7 +107,9 @@ public:
 		SG_MESH
 	};
 	// constructor / destructor
-	~SGNode();
+	SGNode( Arena* a = 0 ) : arena( a ), child( ArenaAllocator<SGNode*>( a ) ) {}
+	virtual ~SGNode();
+	static void Destroy( SGNode* node );
 	// methods
 	void SetPosition( vec3& pos ) { mat4& M = localTransform; M[3] = pos.x, M[7] = pos.y, M[11] = pos.z; }
 	vec3 GetPosition() { mat4& M = localTransform; return vec3( M[3], M[7], M[11] ); }
@@ -68,14 +123,15 @@ public:
 	void RotateYZX( float x, float y, float z ) { RotateABC( y, z, x, 1, 2, 0 ); }
 	void RotateZYX( float x, float y, float z ) { RotateABC( z, y, x, 2, 1, 0 ); }
 	void Add( SGNode* node ) { child.push_back( node ); }
-	void Render( mat4& transform );
+	void Render( mat4& transform, RenderContext& context );
 	virtual int GetType() { return SG_TRANSFORM; }
 private:
 	void RotateABC( float a, float b, float c, int a1, int a2, int a3 );
 	// data members
 public:
 	mat4 localTransform;
-	vector<SGNode*> child;
+	Arena* arena;					// arena holding this node, or 0
+	vector<SGNode*, ArenaAllocator<SGNode*> > child;
 };
 
 // -----------------------------------------------------------
@@ -85,41 +141,140 @@ public:
 class Mesh : public SGNode
 {
 public:
+	// compressed vertex: position quantized to mesh bounds, uv
+	// quantized to the uv range of the mesh, octahedral normal
+	struct QVertex { ushort x, y, z, u, v; uchar nx, ny; };
 	// constructor / destructor
-	Mesh() : verts( 0 ), tris( 0 ), pos( 0 ), uv( 0 ), spos( 0 ) {}
-	Mesh( int vcount, int tcount );
+	Mesh( Arena* a = 0 ) : SGNode( a ), pos( 0 ), uv( 0 ), spos( 0 ), norm( 0 ), N( 0 ), tri( 0 ), qvert( 0 ), tri16( 0 ),
+		verts( 0 ), tris( 0 ), material( 0 ), store( a ), block( 0 ) {}
+	Mesh( int vcount, int tcount, Arena* a = 0 );
 	~Mesh();
 	// methods
-	void Render( mat4& transform );
+	void Allocate( int vcount, int tcount );
+	void Relocate( Arena* target );
+	void Render( mat4& transform, RenderContext& context );
+	bool IsVisible( mat4& transform, RenderContext& context );
+	void Transform( mat4& transform, vec3* tpos );
+	void Bin( mat4& transform, vec3* tpos, RenderContext& context, uchar* bins );
+	void Rasterize( mat4& transform, vec3* tpos, RenderContext& context, const uchar* bins = 0, int band = 0 );
+	void Optimize();
+	int CacheMisses();
+	void UpdateBounds();
+	void Compress();
+	int MemoryUsage();
+	int GetIndex( int i ) { return tri16 ? tri16[i] : tri[i]; }
+	vec2 GetUV( int i ) { return qvert ? vec2( uvBase.x + qvert[i].u * uvScale.x, uvBase.y + qvert[i].v * uvScale.y ) : uv[i]; }
+	vec3 GetPos( int i );
+	vec3 GetNormal( int i );
 	virtual int GetType() { return SG_MESH; }
 	// data members
 	vec3* pos;						// object-space vertex positions
-	vec3* tpos;						// world-space positions
 	vec2* uv;						// vertex uv coordinates
 	vec2* spos;						// screen positions
 	vec3* norm;						// vertex normals
 	vec3* N;						// triangle plane
 	int* tri;						// connectivity data
+	QVertex* qvert;					// compressed vertex data (replaces pos, norm, uv)
+	ushort* tri16;					// compressed connectivity data (replaces tri)
+	vec2 uvBase, uvScale;			// uv dequantization
 	int verts, tris;				// vertex & triangle count
 	Material* material;				// mesh material
 	vec3 bounds[2];					// mesh bounds
-	static Surface* screen;
-	static float* xleft, *xright;	// outline tables for rasterization
-	static float* uleft, *uright;
-	static float* vleft, *vright;
-	static float* zleft, *zright; 
+	Arena* store;					// arena holding the mesh data, or 0 for the heap
+	void* block;					// single allocation that holds all arrays of the mesh
+};
+
+// -----------------------------------------------------------
+// LoadReport struct
+// statistics gathered while loading geometry;
+// ACMR: average cache miss ratio (misses per triangle)
+// ATVR: average transformed vertex ratio (misses per vertex)
+// -----------------------------------------------------------
+struct LoadReport
+{
+	LoadReport() { memset( this, 0, sizeof( LoadReport ) ); }
+	void Print();
+	float ACMR( int misses ) { return tris ? (float)misses / tris : 0; }
+	float ATVR( int misses ) { return verts ? (float)misses / verts : 0; }
+	int meshes, verts, tris;		// loaded geometry
+	int missesBefore, missesAfter;	// simulated vertex cache misses
+	int batches;					// meshes after merging
+	int64 rawBytes, storedBytes;	// geometry memory before / after compression
+	int64 arenaBytes;				// scene arena usage
+	int textures, sharedTextures;	// texture files referenced, of which duplicates
+	int64 sharedBytes;				// texel memory saved by sharing duplicates
+	float loadTime;					// OBJ load time, in ms
+};
+
+// -----------------------------------------------------------
+// TextureResidency class
+// keeps texture memory within a budget by streaming mip levels
+// in and out of the texture .bin files. a render context
+// collects the level it needs per texture, and samples the
+// finest resident level until the requested level has arrived.
+// the coarse tail of each mip chain (MIP_TAIL) stays resident.
+// a budget of 0 disables streaming: textures load completely.
+// changing the resident levels invalidates the levels a frame
+// samples, so frames of all contexts that draw the scene are
+// bracketed by BeginFrame and EndFrame: EndFrame collects the
+// requests of the context, and the last frame to end applies
+// the collected requests of all contexts, while BeginFrame of
+// other frames waits. Mesh::Render draws outside of a frame;
+// use it on scenes without a budget.
+// -----------------------------------------------------------
+#define TEXTURE_BUDGET	0					// bytes; 0: no streaming
+#define STREAM_RATE		(4 * 1024 * 1024)	// bytes streamed in per update, max
+class TextureResidency
+{
+public:
+	TextureResidency() : budget( TEXTURE_BUDGET ), resident( 0 ), streamed( 0 ), evicted( 0 ), rate( STREAM_RATE ), frame( 0 ), drawing( 0 ) {}
+	void BeginFrame();
+	void EndFrame( vector<Texture*>& list, RenderContext& context );
+private:
+	void Update( vector<Texture*>& list );
+	bool Evict( vector<Texture*>& list, int64 bytes );
+public:
+	int64 budget;					// texture memory budget, in bytes
+	int64 resident;					// texture memory in use after the last update
+	int64 streamed, evicted;		// totals, in bytes
+	int rate, frame;				// frame: residency updates so far
+private:
+	std::atomic<int> drawing;		// frames drawing the scene; -1 while an update changes the resident levels
+	std::mutex lock;				// guards pending
+	vector<int> pending;			// per texture: finest level requested by the frames since the last update
+};
+
+// -----------------------------------------------------------
+// NameHash, NameEqual
+// hashing of C strings, for the name registries of the scene
+// -----------------------------------------------------------
+struct NameHash
+{
+	size_t operator()( const char* s ) const { size_t h = 2166136261u; while (*s) h = (h ^ (unsigned char)*s++) * 16777619u; return h; }
+};
+struct NameEqual
+{
+	bool operator()( const char* a, const char* b ) const { return !strcmp( a, b ); }
 };
 
 // -----------------------------------------------------------
 // Scene class
 // owner of the scene graph;
 // owner of the material and texture list
+// loaded geometry, nodes, materials, textures and names live
+// in the scene arena, so that teardown is a handful of frees;
+// the exception is texel storage (file mappings, streamed and
+// truecolor levels), which each texture releases on teardown.
+// names are interned: each distinct name is stored once, and
+// materials and textures are found through hashed registries
+// keyed by the interned name. textures with identical content
+// share a single Texture, regardless of their file names.
 // -----------------------------------------------------------
 class Scene
 {
 public:
 	// constructor / destructor
-	Scene() : root( 0 ), scenePath( 0 ) {}
+	Scene() : root( 0 ), scenePath( 0 ), batchTris( BATCH_TRIS ) {}
 	~Scene();
 	// methods
 	void Render();
@@ -127,15 +282,29 @@ public:
 	SGNode* LoadOBJ( const char* file, const float scale );
 	Material* FindMaterial( const char* name );
 	Texture* FindTexture( const char* name );
+	char* Intern( const char* name );
+	void MergeMeshes( SGNode* node );
 private:
+	Texture* LoadTexture( char* file );
 	void ExtractPath( const char* file );
 	void LoadMTL( const char* file );
+	void BatchMeshes( Mesh** list, int count, SGNode* parent );
+	Mesh* MergeBatch( Mesh** list, int count );
+	void OptimizeMeshes( SGNode* node );
 	// data members
 public:
 	SGNode* root;
+	Arena arena;
+	LoadReport report;
+	TextureResidency residency;
 	vector<Material*> matList;
 	vector<Texture*> texList;
+	unordered_set<char*, NameHash, NameEqual> names;	// interned names
+	unordered_map<const char*, Material*> matIndex;	// keyed by interned name
+	unordered_map<const char*, Texture*> texIndex;	// keyed by interned name
+	unordered_multimap<uint64, Texture*> texContent;	// keyed by content hash
 	char* scenePath;
+	int batchTris;					// max triangles per merged batch; 0 disables merging
 };
 
 // -----------------------------------------------------------
@@ -164,6 +333,20 @@ public:
 	mat4 transform;	
 };
 
+// -----------------------------------------------------------
+// RenderItem struct
+// a mesh in the frame task graph; the cull stage fills in the
+// camera transform and visibility each frame
+// -----------------------------------------------------------
+struct RenderItem
+{
+	Mesh* mesh;
+	mat4 transform;
+	vec3* tpos;						// camera-space positions, valid after the transform stage
+	uchar* bins;					// per triangle: the bands it may cover, valid after the transform stage
+	bool visible;
+};
+
 // -----------------------------------------------------------
 // Rasterizer class
 // rasterizer
@@ -179,20 +362,33 @@ public:
 // - fast OBJ file loading with render state oriented mesh breakdown
 // this rasterizer has been designed for educational purposes
 // and is intentionally small and bare bones.
+// a frame is a task graph (see BuildFrameGraph): the zbuffer
+// clear and the per-mesh transforms overlap with rasterization
+// of meshes whose vertices are ready, and the bands of the
+// target are drawn concurrently, each on its own worker.
 // -----------------------------------------------------------
 class Rasterizer
 {
 public:
 	// constructor / destructor
-	Rasterizer() : scene( 0 ) {}
+	Rasterizer() : scene( 0 ), context( 0 ), graphRoot( 0 ), scratch( 0 ), bins( 0 ) {}
 	~Rasterizer();
 	// methods
 	void Init( Surface* screen );
 	void Render( Camera& camera );
+private:
+	void BuildFrameGraph();
+	void Cull( SGNode* node, mat4& transform, int& item );
 	// data members
-	Scene* scene;	
-	static float* zbuffer;
-	static vec4 frustum[5];
+public:
+	Scene* scene;
+	RenderContext* context;			// target, zbuffer and scratch state of this rasterizer
+	TaskGraph frame;				// stages of a frame, rebuilt when the scene changes
+	vector<RenderItem> items;		// meshes, in scene graph order
+	SGNode* graphRoot;				// scene graph the frame graph was built for
+	vec3* scratch;					// camera-space positions of all meshes
+	uchar* bins;					// band masks of the triangles of all meshes
+	mat4 view;						// inverse camera transform of the current frame
 };
 
 }; // namespace Tmpl8
\ No newline at end of file
@@ -1 +1,959 @@
-#include "precomp.h"
\ No newline at end of file
+#include "precomp.h"
+
+// -----------------------------------------------------------
+// triangle intersection
+// Moller-Trumbore; updates t, u and v when the triangle is hit
+// closer than t
+// -----------------------------------------------------------
+static inline bool HitTriangle( const vec3& O, const vec3& D, const vec3& v0, const vec3& e1, const vec3& e2, float& t, float& u, float& v )
+{
+	const vec3 h = cross( D, e2 );
+	const float a = dot( e1, h );
+	if (fabsf( a ) < 1e-9f) return false; // ray parallel to triangle
+	const float f = 1 / a;
+	const vec3 s = O - v0;
+	const float hu = f * dot( s, h );
+	if (hu < 0 || hu > 1) return false;
+	const vec3 q = cross( s, e1 );
+	const float hv = f * dot( D, q );
+	if (hv < 0 || hu + hv > 1) return false;
+	const float ht = f * dot( e2, q );
+	if (ht <= 1e-5f || ht >= t) return false;
+	t = ht, u = hu, v = hv;
+	return true;
+}
+
+// -----------------------------------------------------------
+// slab test reciprocals
+// direction components are clamped away from zero: an infinite
+// reciprocal times a zero distance would be NaN in the slab test
+// -----------------------------------------------------------
+static inline float SafeRcp( const float d ) { return 1 / (fabsf( d ) > 1e-20f ? d : 1e-20f); }
+static inline vec3 SafeRcp( const vec3& D ) { return vec3( SafeRcp( D.x ), SafeRcp( D.y ), SafeRcp( D.z ) ); }
+static inline __m256 SafeRcp8( const __m256 d8 )
+{
+	const __m256 tiny = _mm256_set1_ps( 1e-20f ), sign = _mm256_set1_ps( -0.0f );
+	return _mm256_div_ps( _mm256_set1_ps( 1 ), _mm256_blendv_ps( d8, tiny, _mm256_cmp_ps( _mm256_andnot_ps( sign, d8 ), tiny, _CMP_LE_OQ ) ) );
+}
+
+// -----------------------------------------------------------
+// Ray::Intersect
+// intersects the ray with a triangle of a mesh, in the object
+// space of the mesh
+// -----------------------------------------------------------
+void Ray::Intersect( Mesh* m, int triIdx )
+{
+	const vec3 v0 = m->GetPos( m->GetIndex( triIdx * 3 ) );
+	const vec3 v1 = m->GetPos( m->GetIndex( triIdx * 3 + 1 ) );
+	const vec3 v2 = m->GetPos( m->GetIndex( triIdx * 3 + 2 ) );
+	if (HitTriangle( O, D, v0, v1 - v0, v2 - v0, t, u, v )) mesh = m, tri = triIdx;
+}
+
+// -----------------------------------------------------------
+// BVH construction
+// -----------------------------------------------------------
+BVH::~BVH()
+{
+	FREE64( node );
+	FREE64( tri );
+	delete[] triMesh;
+	delete[] triIndex;
+}
+
+// meshes of a scene graph, with their world transforms
+static void GatherMeshes( SGNode* node, const mat4& transform, vector<Mesh*>& meshes, vector<mat4>& transforms )
+{
+	const mat4 M = transform * node->localTransform;
+	if (node->GetType() == SGNode::SG_MESH) meshes.push_back( (Mesh*)node ), transforms.push_back( M );
+	for( uint i = 0; i < node->child.size(); i++ ) GatherMeshes( node->child[i], M, meshes, transforms );
+}
+
+typedef std::pair<vec3, vec3> Box;
+static const Box emptyBox( vec3( 1e30f ), vec3( -1e30f ) );
+static inline void Grow( Box& b, const vec3& bmin, const vec3& bmax )
+{
+	b.first = vec3( min( b.first.x, bmin.x ), min( b.first.y, bmin.y ), min( b.first.z, bmin.z ) );
+	b.second = vec3( max( b.second.x, bmax.x ), max( b.second.y, bmax.y ), max( b.second.z, bmax.z ) );
+}
+static Box Merge( const Box& a, const Box& b ) { Box r = a; Grow( r, b.first, b.second ); return r; }
+
+// bounds of the triangles of a node; in parallel for large nodes
+void BVH::UpdateBounds( int nodeIdx )
+{
+	Node& n = node[nodeIdx];
+	auto bounds = [this]( int first, int last ) { Box b = emptyBox; for( int i = first; i < last; i++ ) Grow( b, tmin[idx[i]], tmax[idx[i]] ); return b; };
+	const int first = n.leftFirst, last = first + n.count;
+	const Box b = (n.count >= BVH_PARALLEL) ? parallel_reduce( first, last, 0, emptyBox, bounds, Merge ) : bounds( first, last );
+	n.minx = b.first.x, n.miny = b.first.y, n.minz = b.first.z;
+	n.maxx = b.second.x, n.maxy = b.second.y, n.maxz = b.second.z;
+}
+
+// bins the triangle centroids of a node along the three axes, in one pass
+// over the triangles (in parallel for large nodes), and evaluates the SAH
+// for the planes between the bins; returns the cost of the best split, and
+// the binning of its axis, for the partition
+float BVH::FindBestSplit( Node& n, int& axis, int& split, float& splitMin, float& splitScale )
+{
+	const int first = n.leftFirst, last = first + n.count;
+	const bool wide = n.count >= BVH_PARALLEL;
+	auto centroidBounds = [this]( int f, int l ) { Box b = emptyBox; for( int i = f; i < l; i++ ) Grow( b, centroid[idx[i]], centroid[idx[i]] ); return b; };
+	const Box c = wide ? parallel_reduce( first, last, 0, emptyBox, centroidBounds, Merge ) : centroidBounds( first, last );
+	vec3 scale;
+	for( int a = 0; a < 3; a++ ) scale[a] = (c.second[a] > c.first[a]) ? BVH_BINS / (c.second[a] - c.first[a]) : 0;
+	struct Bins { Bin bin[3][BVH_BINS]; };
+	Bins empty;
+	for( int a = 0; a < 3; a++ ) for( int b = 0; b < BVH_BINS; b++ )
+		empty.bin[a][b].bmin = vec3( 1e30f ), empty.bin[a][b].bmax = vec3( -1e30f ), empty.bin[a][b].count = 0;
+	auto binning = [&]( int f, int l )
+	{
+		Bins s = empty;
+		for( int i = f; i < l; i++ )
+		{
+			const uint t = idx[i];
+			for( int a = 0; a < 3; a++ )
+			{
+				Bin& b = s.bin[a][min( BVH_BINS - 1, (int)((centroid[t][a] - c.first[a]) * scale[a]) )];
+				b.count++;
+				_mm_storeu_ps( b.bmin.cell, _mm_min_ps( _mm_loadu_ps( b.bmin.cell ), _mm_loadu_ps( tmin[t].cell ) ) );
+				_mm_storeu_ps( b.bmax.cell, _mm_max_ps( _mm_loadu_ps( b.bmax.cell ), _mm_loadu_ps( tmax[t].cell ) ) );
+			}
+		}
+		return s;
+	};
+	auto merge = []( const Bins& x, const Bins& y )
+	{
+		Bins s = x;
+		for( int a = 0; a < 3; a++ ) for( int i = 0; i < BVH_BINS; i++ )
+		{
+			Bin& b = s.bin[a][i];
+			const Bin& o = y.bin[a][i];
+			b.count += o.count;
+			b.bmin = vec3( min( b.bmin.x, o.bmin.x ), min( b.bmin.y, o.bmin.y ), min( b.bmin.z, o.bmin.z ) );
+			b.bmax = vec3( max( b.bmax.x, o.bmax.x ), max( b.bmax.y, o.bmax.y ), max( b.bmax.z, o.bmax.z ) );
+		}
+		return s;
+	};
+	const Bins bins = wide ? parallel_reduce( first, last, 0, empty, binning, merge ) : binning( first, last );
+	float best = 1e30f;
+	for( int a = 0; a < 3; a++ )
+	{
+		if (scale[a] == 0) continue;
+		const Bin* bin = bins.bin[a];
+		// sweep from both sides: area and count left and right of each plane
+		float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+		int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+		vec3 lmin( 1e30f ), lmax( -1e30f ), rmin( 1e30f ), rmax( -1e30f );
+		int lsum = 0, rsum = 0;
+		for( int i = 0; i < BVH_BINS - 1; i++ )
+		{
+			const Bin& l = bin[i], &r = bin[BVH_BINS - 1 - i];
+			lsum += l.count, leftCount[i] = lsum;
+			lmin = vec3( min( lmin.x, l.bmin.x ), min( lmin.y, l.bmin.y ), min( lmin.z, l.bmin.z ) );
+			lmax = vec3( max( lmax.x, l.bmax.x ), max( lmax.y, l.bmax.y ), max( lmax.z, l.bmax.z ) );
+			const vec3 le = lmax - lmin;
+			leftArea[i] = lsum ? le.x * le.y + le.y * le.z + le.z * le.x : 0;
+			rsum += r.count, rightCount[BVH_BINS - 2 - i] = rsum;
+			rmin = vec3( min( rmin.x, r.bmin.x ), min( rmin.y, r.bmin.y ), min( rmin.z, r.bmin.z ) );
+			rmax = vec3( max( rmax.x, r.bmax.x ), max( rmax.y, r.bmax.y ), max( rmax.z, r.bmax.z ) );
+			const vec3 re = rmax - rmin;
+			rightArea[BVH_BINS - 2 - i] = rsum ? re.x * re.y + re.y * re.z + re.z * re.x : 0;
+		}
+		for( int i = 0; i < BVH_BINS - 1; i++ )
+		{
+			if (!leftCount[i] || !rightCount[i]) continue;
+			const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (cost < best) axis = a, split = i + 1, best = cost;
+		}
+	}
+	if (axis >= 0) splitMin = c.first[axis], splitScale = scale[axis];
+	return best;
+}
+
+// turns a node into an interior node; its children are allocated as an
+// adjacent pair, and take the first leftCount and the remaining triangles
+int BVH::MakeChildren( int nodeIdx, int leftCount )
+{
+	Node& n = node[nodeIdx];
+	const int left = nextNode.fetch_add( 2 );
+	node[left].leftFirst = n.leftFirst, node[left].count = leftCount;
+	node[left + 1].leftFirst = n.leftFirst + leftCount, node[left + 1].count = n.count - leftCount;
+	n.leftFirst = left, n.count = 0;
+	return left;
+}
+
+// splits a node at the best SAH plane, unless the split costs more than
+// testing all triangles of the node; returns the left child, or 0 for a leaf
+int BVH::SplitSAH( int nodeIdx )
+{
+	Node& n = node[nodeIdx];
+	int axis = -1, split = 0;
+	float cmin, scale;
+	const float area = n.Area();
+	const float splitCost = BVH_TRAVERSAL * area + FindBestSplit( n, axis, split, cmin, scale );
+	if (axis < 0 || splitCost >= n.count * area) return 0;
+	// partition the triangle indices on the bin of their centroid
+	int i = n.leftFirst, j = i + n.count - 1;
+	while (i <= j)
+	{
+		if (min( BVH_BINS - 1, (int)((centroid[idx[i]][axis] - cmin) * scale) ) < split) i++;
+		else { const uint h = idx[i]; idx[i] = idx[j], idx[j--] = h; }
+	}
+	const int leftCount = i - n.leftFirst;
+	if (leftCount == 0 || leftCount == n.count) return 0;
+	const int left = MakeChildren( nodeIdx, leftCount );
+	UpdateBounds( left );
+	UpdateBounds( left + 1 );
+	return left;
+}
+
+// splits the Morton-ordered triangles of a node where the highest bit in
+// which their codes differ flips; a range of equal codes is halved
+int BVH::SplitMorton( int nodeIdx )
+{
+	Node& n = node[nodeIdx];
+	if (n.count <= BVH_LEAF) return 0;
+	const int first = n.leftFirst, last = first + n.count - 1;
+	uint bit = morton[first] ^ morton[last];
+	if (!bit) return MakeChildren( nodeIdx, n.count / 2 );
+	bit |= bit >> 1, bit |= bit >> 2, bit |= bit >> 4, bit |= bit >> 8, bit |= bit >> 16, bit ^= bit >> 1;
+	// the codes share the bits above 'bit': find the first one that has it set
+	int lo = first, hi = last;
+	while (lo < hi)
+	{
+		const int mid = (lo + hi) / 2;
+		if (morton[mid] & bit) hi = mid; else lo = mid + 1;
+	}
+	return MakeChildren( nodeIdx, lo - first );
+}
+
+// splits a node in halves, at the median centroid along the longest axis of
+// its bounds (LBVH: in Morton order, whose halves are spatially coherent)
+int BVH::SplitMedian( int nodeIdx )
+{
+	Node& n = node[nodeIdx];
+	if (n.count <= BVH_LEAF) return 0;
+	const int half = n.count / 2;
+	if (mode == LBVH) return MakeChildren( nodeIdx, half );
+	const float ex = n.maxx - n.minx, ey = n.maxy - n.miny, ez = n.maxz - n.minz;
+	const int axis = (ex >= ey && ex >= ez) ? 0 : (ey >= ez) ? 1 : 2;
+	uint* first = idx + n.leftFirst;
+	std::nth_element( first, first + half, first + n.count, [this, axis]( uint a, uint b ) { return centroid[a][axis] < centroid[b][axis]; } );
+	const int left = MakeChildren( nodeIdx, half );
+	UpdateBounds( left );
+	UpdateBounds( left + 1 );
+	return left;
+}
+
+// spreads the bits of a 10-bit value over 30 bits, two zero bits apart
+static inline uint Spread10( uint v )
+{
+	v = (v * 0x00010001u) & 0xff0000ffu;
+	v = (v * 0x00000101u) & 0x0f00f00fu;
+	v = (v * 0x00000011u) & 0xc30c30c3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// sorts the triangles along a Morton curve through the bounds of their
+// centroids: 30-bit codes, three passes of a parallel radix sort; each
+// chunk of keys scatters to its own offsets, so the sort is stable
+void BVH::SortMorton()
+{
+	auto centroidBounds = [this]( int f, int l ) { Box b = emptyBox; for( int i = f; i < l; i++ ) Grow( b, centroid[i], centroid[i] ); return b; };
+	const Box c = parallel_reduce( 0, triCount, 0, emptyBox, centroidBounds, Merge );
+	vec3 scale;
+	for( int a = 0; a < 3; a++ ) scale[a] = (c.second[a] > c.first[a]) ? 1023.99f / (c.second[a] - c.first[a]) : 0;
+	uint* key = new uint[triCount], *value = idx, *key2 = new uint[triCount], *value2 = new uint[triCount];
+	parallel_for( 0, triCount, 16384, [&]( int first, int last )
+	{
+		for( int i = first; i < last; i++ )
+		{
+			const vec3 p = (centroid[i] - c.first) * scale;
+			key[i] = Spread10( (uint)p.x ) | (Spread10( (uint)p.y ) << 1) | (Spread10( (uint)p.z ) << 2);
+		}
+	} );
+	const int chunks = MIN( 64, MAX( 1, triCount / 16384 ) ), size = (triCount + chunks - 1) / chunks;
+	vector<uint> offset( chunks * 1024 );
+	for( int shift = 0; shift < 30; shift += 10 )
+	{
+		parallel_for( 0, chunks, 1, [&]( int c0, int c1 )
+		{
+			for( int k = c0; k < c1; k++ )
+			{
+				uint* count = &offset[k * 1024];
+				memset( count, 0, 1024 * sizeof( uint ) );
+				for( int i = k * size, end = MIN( triCount, (k + 1) * size ); i < end; i++ ) count[(key[i] >> shift) & 1023]++;
+			}
+		} );
+		for( uint b = 0, sum = 0; b < 1024; b++ ) for( int k = 0; k < chunks; k++ )
+		{
+			const uint count = offset[k * 1024 + b];
+			offset[k * 1024 + b] = sum, sum += count;
+		}
+		parallel_for( 0, chunks, 1, [&]( int c0, int c1 )
+		{
+			for( int k = c0; k < c1; k++ )
+			{
+				uint* next = &offset[k * 1024];
+				for( int i = k * size, end = MIN( triCount, (k + 1) * size ); i < end; i++ )
+				{
+					const uint d = next[(key[i] >> shift) & 1023]++;
+					key2[d] = key[i], value2[d] = value[i];
+				}
+			}
+		} );
+		std::swap( key, key2 ), std::swap( value, value2 );
+	}
+	delete[] key2, delete[] value2;
+	morton = key, idx = value;
+}
+
+// builds the subtree of a node; the left subtree is built by another
+// worker when it is large. LBVH nodes get their bounds bottom-up.
+// a node whose triangles need as many median splits as there are
+// levels left above the stack limit is split at the median, so
+// that no leaf is deeper than BVH_STACK - 1.
+void BVH::Subdivide( int nodeIdx, int depth )
+{
+	assert( depth < BVH_STACK );
+	int levels = 0;
+	for( int count = node[nodeIdx].count; count > BVH_LEAF; count = (count + 1) / 2 ) levels++;
+	const bool median = depth + levels >= BVH_STACK - 1;
+	const int left = median ? SplitMedian( nodeIdx ) : (mode == LBVH) ? SplitMorton( nodeIdx ) : SplitSAH( nodeIdx );
+	if (!left)
+	{
+		if (mode == LBVH) UpdateBounds( nodeIdx );
+		int d = deepest.load();
+		while ((depth > d) && !deepest.compare_exchange_weak( d, depth ));
+		return;
+	}
+	if (median) medians++;
+	JobManager* jm = JobManager::GetJobManager();
+	if (jm && node[left].count >= BVH_TASK)
+	{
+		struct SubtreeJob : public Job
+		{
+			void Main() { bvh->Subdivide( nodeIdx, depth ); }
+			const char* GetName() { return "bvh subtree"; }
+			BVH* bvh;
+			int nodeIdx, depth;
+		} job;
+		job.bvh = this, job.nodeIdx = left, job.depth = depth + 1;
+		JobCounter counter;
+		jm->AddJob2( &job, &counter );
+		Subdivide( left + 1, depth + 1 );
+		jm->Wait( &counter );
+	}
+	else Subdivide( left, depth + 1 ), Subdivide( left + 1, depth + 1 );
+	if (mode != LBVH) return;
+	Node& n = node[nodeIdx];
+	const Node& l = node[left], &r = node[left + 1];
+	n.minx = min( l.minx, r.minx ), n.miny = min( l.miny, r.miny ), n.minz = min( l.minz, r.minz );
+	n.maxx = max( l.maxx, r.maxx ), n.maxy = max( l.maxy, r.maxy ), n.maxz = max( l.maxz, r.maxz );
+}
+
+void BVH::Build( Scene* scene, int buildMode )
+{
+	timer t;
+	mode = buildMode;
+	FREE64( node ), FREE64( tri );
+	delete[] triMesh, delete[] triIndex;
+	// collect the world-space triangles of all meshes; offset: first triangle of each mesh
+	vector<Mesh*> meshes;
+	vector<mat4> transforms;
+	GatherMeshes( scene->root, mat4(), meshes, transforms );
+	vector<int> offset( 1, 0 );
+	for( uint i = 0; i < meshes.size(); i++ ) offset.push_back( offset.back() + meshes[i]->tris );
+	triCount = offset.back();
+	Tri* source = (Tri*)MALLOC64( max( 1, triCount ) * sizeof( Tri ) );
+	Mesh** sourceMesh = new Mesh*[max( 1, triCount )];
+	int* sourceIndex = new int[max( 1, triCount )];
+	idx = new uint[max( 1, triCount )], morton = 0;
+	centroid = new vec3[max( 1, triCount )], tmin = new vec3[max( 1, triCount )], tmax = new vec3[max( 1, triCount )];
+	parallel_for( 0, triCount, 16384, [&]( int first, int last )
+	{
+		int m = (int)(std::upper_bound( offset.begin(), offset.end(), first ) - offset.begin()) - 1;
+		for( int n = first; n < last; n++ )
+		{
+			while (n >= offset[m + 1]) m++;
+			Mesh* mesh = meshes[m];
+			const mat4& M = transforms[m];
+			const int i = n - offset[m];
+			vec3 v[3];
+			for( int k = 0; k < 3; k++ ) v[k] = (M * vec4( mesh->GetPos( mesh->GetIndex( i * 3 + k ) ), 1 )).xyz;
+			source[n].v0 = v[0], source[n].e1 = v[1] - v[0], source[n].e2 = v[2] - v[0];
+			sourceMesh[n] = mesh, sourceIndex[n] = i, idx[n] = n;
+			centroid[n] = (v[0] + v[1] + v[2]) * (1.0f / 3);
+			tmin[n] = vec3( min( min( v[0].x, v[1].x ), v[2].x ), min( min( v[0].y, v[1].y ), v[2].y ), min( min( v[0].z, v[1].z ), v[2].z ) );
+			tmax[n] = vec3( max( max( v[0].x, v[1].x ), v[2].x ), max( max( v[0].y, v[1].y ), v[2].y ), max( max( v[0].z, v[1].z ), v[2].z ) );
+		}
+	} );
+	// build: a binary tree over n triangles has at most 2n - 1 nodes, plus the unused node 1
+	node = (Node*)MALLOC64( (max( 1, triCount ) * 2 + 1) * sizeof( Node ) );
+	node[0].leftFirst = 0, node[0].count = triCount, nextNode = 2, deepest = 0, medians = 0;
+	if (triCount > 0)
+	{
+		if (mode == LBVH) SortMorton(); else UpdateBounds( 0 );
+		Subdivide( 0, 0 );
+	}
+	else node[0].minx = node[0].miny = node[0].minz = 1e30f, node[0].maxx = node[0].maxy = node[0].maxz = -1e30f;
+	nodesUsed = nextNode, maxDepth = deepest, medianSplits = medians;
+	// store the triangles in leaf order
+	tri = (Tri*)MALLOC64( max( 1, triCount ) * sizeof( Tri ) );
+	triMesh = new Mesh*[max( 1, triCount )], triIndex = new int[max( 1, triCount )];
+	parallel_for( 0, triCount, 16384, [&]( int first, int last )
+	{
+		for( int i = first; i < last; i++ ) tri[i] = source[idx[i]], triMesh[i] = sourceMesh[idx[i]], triIndex[i] = sourceIndex[idx[i]];
+	} );
+	FREE64( source );
+	delete[] sourceMesh, delete[] sourceIndex;
+	delete[] idx, delete[] morton, delete[] centroid, delete[] tmin, delete[] tmax;
+	idx = morton = 0, centroid = tmin = tmax = 0;
+	buildTime = t.elapsed();
+}
+
+// expected cost of a random ray that hits the root, in triangle tests:
+// node visits and triangle tests, weighted by surface area
+float BVH::SAHCost()
+{
+	const float rootArea = node[0].Area();
+	if (rootArea <= 0) return 0;
+	float cost = 0;
+	for( int i = 0; i < nodesUsed; i++ ) if (i != 1)
+		cost += node[i].Area() * (node[i].IsLeaf() ? node[i].count : BVH_TRAVERSAL);
+	return cost / rootArea;
+}
+
+// -----------------------------------------------------------
+// BVH traversal
+// ordered: the nearest child is visited first, the other one
+// is pushed on a small stack
+// -----------------------------------------------------------
+static inline float IntersectAABB( const __m128 O4, const __m128 rD4, const BVH::Node& n, const float t )
+{
+	const __m128 t1 = _mm_mul_ps( _mm_sub_ps( n.bmin4, O4 ), rD4 ), t2 = _mm_mul_ps( _mm_sub_ps( n.bmax4, O4 ), rD4 );
+	const __m128 vmax4 = _mm_max_ps( t1, t2 ), vmin4 = _mm_min_ps( t1, t2 );
+	float vmax[4], vmin[4];
+	_mm_storeu_ps( vmax, vmax4 ), _mm_storeu_ps( vmin, vmin4 );
+	const float tmax = min( vmax[0], min( vmax[1], vmax[2] ) ), tmin = max( vmin[0], max( vmin[1], vmin[2] ) );
+	return (tmax >= tmin && tmin < t && tmax > 0) ? tmin : 1e30f;
+}
+
+void BVH::Intersect( Ray& ray )
+{
+	const vec3 rD = SafeRcp( ray.D );
+	const __m128 O4 = _mm_setr_ps( ray.O.x, ray.O.y, ray.O.z, 0 );
+	const __m128 rD4 = _mm_setr_ps( rD.x, rD.y, rD.z, 1 );
+	if (IntersectAABB( O4, rD4, node[0], ray.t ) == 1e30f) return;
+	const Node* n = &node[0], *stack[BVH_STACK];
+	int sp = 0, best = -1;
+	while (1)
+	{
+		if (n->IsLeaf())
+		{
+			for( int i = 0; i < n->count; i++ )
+			{
+				const Tri& T = tri[n->leftFirst + i];
+				if (HitTriangle( ray.O, ray.D, T.v0, T.e1, T.e2, ray.t, ray.u, ray.v )) best = n->leftFirst + i;
+			}
+			if (!sp) break;
+			n = stack[--sp];
+			continue;
+		}
+		const Node* c1 = &node[n->leftFirst], *c2 = c1 + 1;
+		float d1 = IntersectAABB( O4, rD4, *c1, ray.t ), d2 = IntersectAABB( O4, rD4, *c2, ray.t );
+		if (d1 > d2) { const float d = d1; d1 = d2, d2 = d; const Node* c = c1; c1 = c2, c2 = c; }
+		if (d1 == 1e30f)
+		{
+			if (!sp) break;
+			n = stack[--sp];
+		}
+		else
+		{
+			n = c1;
+			if (d2 != 1e30f) stack[sp++] = c2;
+		}
+	}
+	if (best >= 0) ray.prim = best, ray.mesh = triMesh[best], ray.tri = triIndex[best];
+}
+
+bool BVH::IsOccluded( Ray& ray )
+{
+	const vec3 rD = SafeRcp( ray.D );
+	const __m128 O4 = _mm_setr_ps( ray.O.x, ray.O.y, ray.O.z, 0 );
+	const __m128 rD4 = _mm_setr_ps( rD.x, rD.y, rD.z, 1 );
+	const Node* stack[BVH_STACK + 1];
+	int sp = 0;
+	stack[sp++] = &node[0];
+	float t = ray.t, u, v;
+	while (sp)
+	{
+		const Node* n = stack[--sp];
+		if (IntersectAABB( O4, rD4, *n, t ) == 1e30f) continue;
+		if (n->IsLeaf())
+		{
+			for( int i = 0; i < n->count; i++ )
+			{
+				const Tri& T = tri[n->leftFirst + i];
+				if (HitTriangle( ray.O, ray.D, T.v0, T.e1, T.e2, t, u, v )) return true;
+			}
+		}
+		else stack[sp++] = &node[n->leftFirst], stack[sp++] = &node[n->leftFirst + 1];
+	}
+	return false;
+}
+
+// -----------------------------------------------------------
+// BVH packet traversal
+// ranged traversal: a node is entered with the first ray group
+// that may hit it. the node is tested against that group; if it
+// misses, the packet frustum may cull the node as a whole, and
+// otherwise the remaining groups are tested, until one hits and
+// becomes the first group of the subtree. leaves test one
+// triangle against 8 rays at a time. the packet has diverged
+// when, over its first leaves, few rays hit the leaf bounds;
+// traversal then stops and returns false, and the rays are to
+// be completed one by one (the hits found so far remain valid).
+// -----------------------------------------------------------
+#define PACKET_PROBE	16		// leaves visited before the divergence test
+#define PACKET_ACTIVE	4		// average rays per leaf below which a packet has diverged
+
+// node bounds relative to the packet origin, broadcast
+struct PacketBox
+{
+	PacketBox( const BVH::Node& n, const vec3& O )
+	{
+		lo[0] = _mm256_set1_ps( n.minx - O.x ), lo[1] = _mm256_set1_ps( n.miny - O.y ), lo[2] = _mm256_set1_ps( n.minz - O.z );
+		hi[0] = _mm256_set1_ps( n.maxx - O.x ), hi[1] = _mm256_set1_ps( n.maxy - O.y ), hi[2] = _mm256_set1_ps( n.maxz - O.z );
+	}
+	// mask of the rays of a group that hit the box closer than their t
+	inline int Test( const RayPacket& p, int g ) const
+	{
+		const __m256 tx1 = _mm256_mul_ps( lo[0], p.rDx8[g] ), tx2 = _mm256_mul_ps( hi[0], p.rDx8[g] );
+		const __m256 ty1 = _mm256_mul_ps( lo[1], p.rDy8[g] ), ty2 = _mm256_mul_ps( hi[1], p.rDy8[g] );
+		const __m256 tz1 = _mm256_mul_ps( lo[2], p.rDz8[g] ), tz2 = _mm256_mul_ps( hi[2], p.rDz8[g] );
+		const __m256 tmin8 = _mm256_max_ps( _mm256_max_ps( _mm256_min_ps( tx1, tx2 ), _mm256_min_ps( ty1, ty2 ) ), _mm256_max_ps( _mm256_min_ps( tz1, tz2 ), _mm256_setzero_ps() ) );
+		const __m256 tmax8 = _mm256_min_ps( _mm256_min_ps( _mm256_max_ps( tx1, tx2 ), _mm256_max_ps( ty1, ty2 ) ), _mm256_min_ps( _mm256_max_ps( tz1, tz2 ), p.t8[g] ) );
+		return _mm256_movemask_ps( _mm256_cmp_ps( tmin8, tmax8, _CMP_LE_OQ ) );
+	}
+	__m256 lo[3], hi[3];
+};
+
+// true if the box is entirely outside one of the frustum planes
+static inline bool OutsideFrustum( const RayPacket& p, const BVH::Node& n )
+{
+	for( int i = 0; i < 4; i++ )
+	{
+		const vec3& N = p.plane[i];
+		const float x = (N.x > 0 ? n.maxx : n.minx) - p.O.x, y = (N.y > 0 ? n.maxy : n.miny) - p.O.y, z = (N.z > 0 ? n.maxz : n.minz) - p.O.z;
+		if (N.x * x + N.y * y + N.z * z < 0) return true;
+	}
+	return false;
+}
+
+// Moller-Trumbore for the 8 rays of a group; with a shared origin, the
+// terms that only depend on the origin and the triangle are scalar
+static inline void HitTriangle8( RayPacket& p, int g, const BVH::Tri& T, int prim )
+{
+	const vec3 s = p.O - T.v0, q = cross( s, T.e1 );
+	const __m256 Dx = p.Dx8[g], Dy = p.Dy8[g], Dz = p.Dz8[g];
+	const __m256 e2x = _mm256_set1_ps( T.e2.x ), e2y = _mm256_set1_ps( T.e2.y ), e2z = _mm256_set1_ps( T.e2.z );
+	const __m256 hx = _mm256_sub_ps( _mm256_mul_ps( Dy, e2z ), _mm256_mul_ps( Dz, e2y ) );
+	const __m256 hy = _mm256_sub_ps( _mm256_mul_ps( Dz, e2x ), _mm256_mul_ps( Dx, e2z ) );
+	const __m256 hz = _mm256_sub_ps( _mm256_mul_ps( Dx, e2y ), _mm256_mul_ps( Dy, e2x ) );
+	const __m256 a = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( _mm256_set1_ps( T.e1.x ), hx ), _mm256_mul_ps( _mm256_set1_ps( T.e1.y ), hy ) ), _mm256_mul_ps( _mm256_set1_ps( T.e1.z ), hz ) );
+	const __m256 f = _mm256_div_ps( _mm256_set1_ps( 1 ), a );
+	const __m256 u = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( _mm256_set1_ps( s.x ), hx ), _mm256_mul_ps( _mm256_set1_ps( s.y ), hy ) ), _mm256_mul_ps( _mm256_set1_ps( s.z ), hz ) ) );
+	const __m256 v = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( Dx, _mm256_set1_ps( q.x ) ), _mm256_mul_ps( Dy, _mm256_set1_ps( q.y ) ) ), _mm256_mul_ps( Dz, _mm256_set1_ps( q.z ) ) ) );
+	const __m256 t = _mm256_mul_ps( f, _mm256_set1_ps( dot( T.e2, q ) ) );
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps( 1 );
+	const __m256 absA = _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), a );
+	__m256 hit = _mm256_and_ps( _mm256_cmp_ps( absA, _mm256_set1_ps( 1e-9f ), _CMP_GE_OQ ), _mm256_cmp_ps( u, zero, _CMP_GE_OQ ) );
+	hit = _mm256_and_ps( hit, _mm256_and_ps( _mm256_cmp_ps( v, zero, _CMP_GE_OQ ), _mm256_cmp_ps( _mm256_add_ps( u, v ), one, _CMP_LE_OQ ) ) );
+	hit = _mm256_and_ps( hit, _mm256_and_ps( _mm256_cmp_ps( t, _mm256_set1_ps( 1e-5f ), _CMP_GT_OQ ), _mm256_cmp_ps( t, p.t8[g], _CMP_LT_OQ ) ) );
+	if (!_mm256_movemask_ps( hit )) return;
+	p.t8[g] = _mm256_blendv_ps( p.t8[g], t, hit );
+	p.u8[g] = _mm256_blendv_ps( p.u8[g], u, hit );
+	p.v8[g] = _mm256_blendv_ps( p.v8[g], v, hit );
+	p.prim8[g] = _mm256_castps_si256( _mm256_blendv_ps( _mm256_castsi256_ps( p.prim8[g] ), _mm256_castsi256_ps( _mm256_set1_epi32( prim ) ), hit ) );
+}
+
+bool BVH::IntersectPacket( RayPacket& p )
+{
+	struct Entry { int node, first; } stack[BVH_STACK];
+	int sp = 0, leaves = 0, active = 0;
+	stack[sp].node = 0, stack[sp++].first = 0;
+	while (sp)
+	{
+		const Entry e = stack[--sp];
+		const Node& n = node[e.node];
+		const PacketBox box( n, p.O );
+		int first = e.first, mask = box.Test( p, first );
+		if (!mask)
+		{
+			if (OutsideFrustum( p, n )) continue;
+			while (++first < PACKET_SIZE) if ((mask = box.Test( p, first ))) break;
+			if (!mask) continue;
+		}
+		if (n.IsLeaf())
+		{
+			for( int g = first; g < PACKET_SIZE; g++ )
+			{
+				if (g > first) mask = box.Test( p, g );
+				if (!mask) continue;
+				for( int m = mask; m; m &= m - 1 ) active++;
+				for( int i = 0; i < n.count; i++ ) HitTriangle8( p, g, tri[n.leftFirst + i], n.leftFirst + i );
+			}
+			if (++leaves == PACKET_PROBE && active < PACKET_PROBE * PACKET_ACTIVE) return false;
+			continue;
+		}
+		// near child first, along the direction of the center of the packet
+		const Node& c1 = node[n.leftFirst], &c2 = node[n.leftFirst + 1];
+		const float d1 = (c1.minx + c1.maxx) * p.center.x + (c1.miny + c1.maxy) * p.center.y + (c1.minz + c1.maxz) * p.center.z;
+		const float d2 = (c2.minx + c2.maxx) * p.center.x + (c2.miny + c2.maxy) * p.center.y + (c2.minz + c2.maxz) * p.center.z;
+		const int nearChild = d1 <= d2 ? n.leftFirst : n.leftFirst + 1;
+		stack[sp].node = 2 * n.leftFirst + 1 - nearChild, stack[sp++].first = first;
+		stack[sp].node = nearChild, stack[sp++].first = first;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------
+// BVH8 construction
+// each BVH8 node replaces a binary interior node and (part of)
+// its subtree: starting with the two children of the binary
+// node, the interior child with the largest surface area is
+// replaced by its own children, until there are 8 children or
+// only leaves. every BVH8 node comes from a distinct binary
+// interior node, which bounds the node count.
+// -----------------------------------------------------------
+BVH8::~BVH8()
+{
+	FREE64( node );
+}
+
+void BVH8::Collapse( int binaryIdx, int idx )
+{
+	const BVH::Node* src = bvh->node;
+	int slot[8], slots = 2;
+	slot[0] = src[binaryIdx].leftFirst, slot[1] = slot[0] + 1;
+	while (slots < 8)
+	{
+		int open = -1;
+		float area = -1;
+		for( int i = 0; i < slots; i++ ) if (!src[slot[i]].IsLeaf() && src[slot[i]].Area() > area) open = i, area = src[slot[i]].Area();
+		if (open < 0) break;
+		const int first = src[slot[open]].leftFirst;
+		slot[open] = first, slot[slots++] = first + 1;
+	}
+	Node& n = node[idx];
+	for( int i = 0; i < 8; i++ )
+	{
+		if (i >= slots)
+		{
+			for( int a = 0; a < 3; a++ ) n.bmin[a][i] = n.bmax[a][i] = 0;
+			n.child[i] = 0, n.count[i] = -1;
+			continue;
+		}
+		const BVH::Node& c = src[slot[i]];
+		n.bmin[0][i] = c.minx, n.bmin[1][i] = c.miny, n.bmin[2][i] = c.minz;
+		n.bmax[0][i] = c.maxx, n.bmax[1][i] = c.maxy, n.bmax[2][i] = c.maxz;
+		if (c.IsLeaf()) n.child[i] = c.leftFirst, n.count[i] = c.count;
+		else n.child[i] = nodesUsed++, n.count[i] = 0;
+	}
+	for( int i = 0; i < slots; i++ ) if (!n.count[i]) Collapse( slot[i], n.child[i] );
+}
+
+void BVH8::Build( const BVH& source )
+{
+	timer t;
+	FREE64( node );
+	bvh = &source;
+	// every node of the wide tree collapses at least one interior node of the binary tree
+	int interior = 0;
+	for( int i = 0; i < source.nodesUsed; i++ ) if (i != 1 && !source.node[i].IsLeaf()) interior++;
+	node = (Node*)MALLOC64( max( 1, interior ) * sizeof( Node ) );
+	nodesUsed = 1;
+	const BVH::Node& root = source.node[0];
+	if (root.IsLeaf() || !source.triCount)
+	{
+		// a single leaf (or nothing) under the root
+		Node& n = node[0];
+		for( int i = 0; i < 8; i++ )
+		{
+			n.bmin[0][i] = root.minx, n.bmin[1][i] = root.miny, n.bmin[2][i] = root.minz;
+			n.bmax[0][i] = root.maxx, n.bmax[1][i] = root.maxy, n.bmax[2][i] = root.maxz;
+			n.child[i] = 0, n.count[i] = (i == 0 && root.count > 0) ? root.count : -1;
+		}
+	}
+	else
+	{
+		// collapsing opens up to 7 interior nodes per wide node: shrink to what was used
+		Collapse( 0, 0 );
+		Node* used = (Node*)MALLOC64( nodesUsed * sizeof( Node ) );
+		memcpy( used, node, nodesUsed * sizeof( Node ) );
+		FREE64( node );
+		node = used;
+	}
+	buildTime = t.elapsed();
+}
+
+// -----------------------------------------------------------
+// BVH8 traversal
+// the slab test of 8 children in one go; the hit children are
+// pushed farthest first, so that the nearest one is popped
+// next. stack entries keep their entry distance, and are
+// skipped when a closer hit has been found in the meantime.
+// -----------------------------------------------------------
+struct BVH8Ray
+{
+	BVH8Ray( const Ray& ray )
+	{
+		const vec3 rD = SafeRcp( ray.D );
+		rD8[0] = _mm256_set1_ps( rD.x ), rD8[1] = _mm256_set1_ps( rD.y ), rD8[2] = _mm256_set1_ps( rD.z );
+		OrD8[0] = _mm256_set1_ps( ray.O.x * rD.x ), OrD8[1] = _mm256_set1_ps( ray.O.y * rD.y ), OrD8[2] = _mm256_set1_ps( ray.O.z * rD.z );
+	}
+	// entry distances of the children of a node, and the mask of the children
+	// that are hit closer than t
+	inline int Test( const BVH8::Node& n, const float t, __m256& tmin8 ) const
+	{
+		const __m256 tx1 = _mm256_fmsub_ps( n.bmin8[0], rD8[0], OrD8[0] ), tx2 = _mm256_fmsub_ps( n.bmax8[0], rD8[0], OrD8[0] );
+		const __m256 ty1 = _mm256_fmsub_ps( n.bmin8[1], rD8[1], OrD8[1] ), ty2 = _mm256_fmsub_ps( n.bmax8[1], rD8[1], OrD8[1] );
+		const __m256 tz1 = _mm256_fmsub_ps( n.bmin8[2], rD8[2], OrD8[2] ), tz2 = _mm256_fmsub_ps( n.bmax8[2], rD8[2], OrD8[2] );
+		tmin8 = _mm256_max_ps( _mm256_max_ps( _mm256_min_ps( tx1, tx2 ), _mm256_min_ps( ty1, ty2 ) ), _mm256_max_ps( _mm256_min_ps( tz1, tz2 ), _mm256_setzero_ps() ) );
+		const __m256 tmax8 = _mm256_min_ps( _mm256_min_ps( _mm256_max_ps( tx1, tx2 ), _mm256_max_ps( ty1, ty2 ) ), _mm256_min_ps( _mm256_max_ps( tz1, tz2 ), _mm256_set1_ps( t ) ) );
+		const int empty = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_load_si256( (const __m256i*)n.count ) ) );
+		return _mm256_movemask_ps( _mm256_cmp_ps( tmin8, tmax8, _CMP_LE_OQ ) ) & ~empty;
+	}
+	__m256 rD8[3], OrD8[3];
+};
+
+void BVH8::Intersect( Ray& ray )
+{
+	const BVH8Ray r( ray );
+	struct Entry { int child, count; float t; } stack[BVH8_STACK];
+	int sp = 0, best = -1;
+	stack[sp].child = 0, stack[sp].count = 0, stack[sp++].t = 0;
+	while (sp)
+	{
+		const Entry e = stack[--sp];
+		if (e.t >= ray.t) continue;
+		if (e.count > 0)
+		{
+			for( int i = 0; i < e.count; i++ )
+			{
+				const BVH::Tri& T = bvh->tri[e.child + i];
+				if (HitTriangle( ray.O, ray.D, T.v0, T.e1, T.e2, ray.t, ray.u, ray.v )) best = e.child + i;
+			}
+			continue;
+		}
+		const Node& n = node[e.child];
+		__m256 tmin8;
+		int mask = r.Test( n, ray.t, tmin8 );
+		if (!mask) continue;
+		float d[8];
+		_mm256_storeu_ps( d, tmin8 );
+		// insertion sort of the hit children on distance, farthest first
+		int hit[8], hits = 0;
+		for( ; mask; mask &= mask - 1 )
+		{
+			int i = 0;
+			while (!(mask & (1 << i))) i++;
+			int j = hits++;
+			for( ; j > 0 && d[hit[j - 1]] < d[i]; j-- ) hit[j] = hit[j - 1];
+			hit[j] = i;
+		}
+		for( int k = 0; k < hits; k++ )
+			stack[sp].child = n.child[hit[k]], stack[sp].count = n.count[hit[k]], stack[sp++].t = d[hit[k]];
+	}
+	if (best >= 0) ray.prim = best, ray.mesh = bvh->triMesh[best], ray.tri = bvh->triIndex[best];
+}
+
+bool BVH8::IsOccluded( Ray& ray )
+{
+	const BVH8Ray r( ray );
+	int stack[BVH8_STACK], sp = 0;
+	stack[sp++] = 0;
+	float t = ray.t, u, v;
+	while (sp)
+	{
+		const Node& n = node[stack[--sp]];
+		__m256 tmin8;
+		for( int mask = r.Test( n, t, tmin8 ); mask; mask &= mask - 1 )
+		{
+			int i = 0;
+			while (!(mask & (1 << i))) i++;
+			if (!n.count[i]) { stack[sp++] = n.child[i]; continue; }
+			for( int k = 0; k < n.count[i]; k++ )
+			{
+				const BVH::Tri& T = bvh->tri[n.child[i] + k];
+				if (HitTriangle( ray.O, ray.D, T.v0, T.e1, T.e2, t, u, v )) return true;
+			}
+		}
+	}
+	return false;
+}
+
+// -----------------------------------------------------------
+// Raytracer implementation
+// -----------------------------------------------------------
+Raytracer::~Raytracer() {} // the scene is not ours
+
+// -----------------------------------------------------------
+// Raytracer::Init
+// builds the BVH over the triangles of the scene
+// input: surface to draw to, BVH build mode
+// -----------------------------------------------------------
+void Raytracer::Init( Surface* target, int bvhMode )
+{
+	screen = target;
+	if (!scene) return;
+	bvh.Build( scene, bvhMode );
+#ifdef VERBOSE
+	printf( "bvh (%s): %i triangles, %i nodes, depth %i, %i median splits, %.1fms, SAH cost %.2f\n", bvhMode == BVH::LBVH ? "LBVH" : "SAH",
+		bvh.triCount, bvh.nodesUsed - 1, bvh.maxDepth, bvh.medianSplits, bvh.buildTime, bvh.SAHCost() );
+#endif
+#ifdef BVH8_TRACE
+	bvh8.Build( bvh );
+#ifdef VERBOSE
+	printf( "bvh8: %i nodes, %.1fms\n", bvh8.nodesUsed, bvh8.buildTime );
+#endif
+#endif
+}
+
+// nearest intersection along the ray: sets t, prim, mesh, tri, u and v
+void Raytracer::FindNearest( Ray& ray )
+{
+#ifdef BVH8_TRACE
+	bvh8.Intersect( ray );
+#else
+	bvh.Intersect( ray );
+#endif
+}
+
+// any intersection closer than t
+bool Raytracer::IsOccluded( Ray& ray )
+{
+#ifdef BVH8_TRACE
+	return bvh8.IsOccluded( ray );
+#else
+	return bvh.IsOccluded( ray );
+#endif
+}
+
+// the inverse of the rasterizer projection: camera space x and y are
+// scaled by the screen width, the camera looks along -z
+Ray Raytracer::PrimaryRay( Camera& camera, float x, float y )
+{
+	const float W = (float)screen->GetWidth(), H = (float)screen->GetHeight();
+	const vec3 d( (x - W / 2) / W, (H / 2 - y) / W, -1 );
+	mat4& M = camera.transform;
+	const vec3 D( M[0] * d.x + M[1] * d.y + M[2] * d.z, M[4] * d.x + M[5] * d.y + M[6] * d.z, M[8] * d.x + M[9] * d.y + M[10] * d.z );
+	return Ray( camera.GetPosition(), normalize( D ), 1e30f );
+}
+
+// the primary rays of the tile at (x0, y0), and the frustum of its corner rays
+void Raytracer::PrimaryPacket( Camera& camera, int x0, int y0, RayPacket& p )
+{
+	p.O = camera.GetPosition();
+	p.center = PrimaryRay( camera, x0 + PACKET_SIZE / 2.0f, y0 + PACKET_SIZE / 2.0f ).D;
+	for( int y = 0; y < PACKET_SIZE; y++ )
+	{
+		for( int x = 0; x < 8; x++ )
+		{
+			const vec3 D = PrimaryRay( camera, x0 + x + 0.5f, y0 + y + 0.5f ).D;
+			p.Dx[y][x] = D.x, p.Dy[y][x] = D.y, p.Dz[y][x] = D.z;
+		}
+		p.rDx8[y] = SafeRcp8( p.Dx8[y] ), p.rDy8[y] = SafeRcp8( p.Dy8[y] ), p.rDz8[y] = SafeRcp8( p.Dz8[y] );
+		p.t8[y] = _mm256_set1_ps( 1e30f ), p.u8[y] = p.v8[y] = _mm256_setzero_ps(), p.prim8[y] = _mm256_set1_epi32( -1 );
+	}
+	const int last = PACKET_SIZE - 1;
+	const vec3 corner[4] = { vec3( p.Dx[0][0], p.Dy[0][0], p.Dz[0][0] ), vec3( p.Dx[0][last], p.Dy[0][last], p.Dz[0][last] ),
+		vec3( p.Dx[last][last], p.Dy[last][last], p.Dz[last][last] ), vec3( p.Dx[last][0], p.Dy[last][0], p.Dz[last][0] ) };
+	for( int i = 0; i < 4; i++ )
+	{
+		const vec3 N = cross( corner[i], corner[(i + 1) & 3] );
+		p.plane[i] = dot( N, p.center ) < 0 ? -N : N;
+	}
+}
+
+// texel of the finest resident level, unfiltered, from the unscaled palette
+static Pixel Texel( Surface8* t, float u, float v )
+{
+	const int level = t->GetResidentLevel(), w = t->GetWidth( level ), h = t->GetHeight( level ), shift = t->GetWidthShift( level );
+	const int x = (int)floorf( u * w ) & (w - 1), y = (int)floorf( v * h ) & (h - 1);
+	const unsigned char* src = t->GetBuffer( level );
+	const int layout = t->GetLevelLayout( level );
+	if (layout == Surface8::LINEAR) return t->GetBasePalette()[src[x + (y << shift)]];
+	const int addr = Surface8::TiledAddress( x, y, shift );
+	return t->GetBasePalette()[(layout == Surface8::TILED) ? src[addr] : Surface8::Block4Index( src, t->GetSubPalettes( level ), addr )];
+}
+
+// texture color, lit by a light at the eye
+Pixel Raytracer::Shade( Ray& ray )
+{
+	if (ray.prim < 0) return 0;
+	Mesh* m = ray.mesh;
+	Pixel color = 0xffffff;
+	if (m->material && m->material->texture)
+	{
+		const float w = 1 - ray.u - ray.v;
+		const vec2 uv0 = m->GetUV( m->GetIndex( ray.tri * 3 ) ), uv1 = m->GetUV( m->GetIndex( ray.tri * 3 + 1 ) ), uv2 = m->GetUV( m->GetIndex( ray.tri * 3 + 2 ) );
+		color = Texel( m->material->texture->pixels, w * uv0.x + ray.u * uv1.x + ray.v * uv2.x, w * uv0.y + ray.u * uv1.y + ray.v * uv2.y );
+	}
+	const BVH::Tri& T = bvh.tri[ray.prim];
+	const vec3 N = normalize( cross( T.e1, T.e2 ) );
+	const uint scale = (uint)(64 + 192 * fabsf( dot( N, ray.D ) ));
+	const uint rb = (((color & 0xff00ff) * scale) >> 8) & 0xff00ff, g = (((color & 0xff00) * scale) >> 8) & 0xff00;
+	return rb + g;
+}
+
+// -----------------------------------------------------------
+// Raytracer::Render
+// primary rays, one per pixel: screen tiles are traced as ray
+// packets, in parallel; when a packet diverges, its rays are
+// completed one by one. without packets: rows of single rays.
+// input: camera to render with
+// -----------------------------------------------------------
+void Raytracer::Render( Camera& camera )
+{
+	const int W = screen->GetWidth(), H = screen->GetHeight(), pitch = screen->GetPitch();
+	Pixel* buffer = screen->GetBuffer();
+	if (!packets)
+	{
+		parallel_for( 0, H, 4, [&]( int first, int last )
+		{
+			for( int y = first; y < last; y++ ) for( int x = 0; x < W; x++ )
+			{
+				Ray ray = PrimaryRay( camera, x + 0.5f, y + 0.5f );
+				FindNearest( ray );
+				buffer[x + y * pitch] = Shade( ray );
+			}
+		} );
+		return;
+	}
+	const int tilesX = (W + PACKET_SIZE - 1) / PACKET_SIZE, tiles = tilesX * ((H + PACKET_SIZE - 1) / PACKET_SIZE);
+	parallel_for( 0, tiles, 4, [&]( int first, int last )
+	{
+		RayPacket p;
+		int diverged = 0;
+		for( int tile = first; tile < last; tile++ )
+		{
+			const int x0 = (tile % tilesX) * PACKET_SIZE, y0 = (tile / tilesX) * PACKET_SIZE;
+			PrimaryPacket( camera, x0, y0, p );
+			const bool coherent = bvh.IntersectPacket( p );
+			diverged += !coherent;
+			for( int y = 0; y < PACKET_SIZE && y0 + y < H; y++ ) for( int x = 0; x < PACKET_SIZE && x0 + x < W; x++ )
+			{
+				Ray ray( p.O, vec3( p.Dx[y][x], p.Dy[y][x], p.Dz[y][x] ), p.t[y][x] );
+				ray.prim = p.prim[y][x], ray.u = p.u[y][x], ray.v = p.v[y][x];
+				if (!coherent) FindNearest( ray );
+				if (ray.prim >= 0) ray.mesh = bvh.triMesh[ray.prim], ray.tri = bvh.triIndex[ray.prim];
+				buffer[x0 + x + (y0 + y) * pitch] = Shade( ray );
+			}
+		}
+		packetCount += last - first, divergedCount += diverged;
+	} );
+}
+
+// EOF
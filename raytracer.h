@@ -10,31 +10,176 @@ class Ray
 {
 public:
 	// constructor / destructor
-	Ray( vec3 origin, vec3 direction, float distance ) : O( origin ), D( direction ), t( distance ) {}
+	Ray( vec3 origin, vec3 direction, float distance ) : O( origin ), D( direction ), t( distance ), mesh( 0 ), tri( -1 ), prim( -1 ) {}
 	// methods
 	void Intersect( Mesh* mesh, int triIdx );
 	// data members
 	vec3 O, D;
 	float t;
+	Mesh* mesh;						// nearest hit: mesh and triangle index,
+	int tri;						// and barycentrics of the hit point
+	float u, v;
+	int prim;						// nearest hit in the BVH triangle array
+};
+
+// -----------------------------------------------------------
+// RayPacket struct
+// PACKET_SIZE x PACKET_SIZE rays with a shared origin, such as
+// the primary rays of a screen tile: one group of 8 SIMD lanes
+// per row. planes are the side planes of the frustum through
+// the corner rays, with inward normals.
+// -----------------------------------------------------------
+#define PACKET_SIZE		8
+struct RayPacket
+{
+	vec3 O, center;					// shared origin, direction of a ray near the center
+	vec3 plane[4];
+	union { __m256 Dx8[PACKET_SIZE]; float Dx[PACKET_SIZE][8]; };
+	union { __m256 Dy8[PACKET_SIZE]; float Dy[PACKET_SIZE][8]; };
+	union { __m256 Dz8[PACKET_SIZE]; float Dz[PACKET_SIZE][8]; };
+	__m256 rDx8[PACKET_SIZE], rDy8[PACKET_SIZE], rDz8[PACKET_SIZE];
+	union { __m256 t8[PACKET_SIZE]; float t[PACKET_SIZE][8]; };
+	union { __m256 u8[PACKET_SIZE]; float u[PACKET_SIZE][8]; };
+	union { __m256 v8[PACKET_SIZE]; float v[PACKET_SIZE][8]; };
+	union { __m256i prim8[PACKET_SIZE]; int prim[PACKET_SIZE][8]; };
+};
+
+// -----------------------------------------------------------
+// BVH class
+// bounding volume hierarchy over the world-space triangles of
+// a scene, built with binned SAH. nodes are 32 bytes; the two
+// children of a node are adjacent, and each pair shares a
+// 64-byte cache line (node 1 is unused to align the pairs).
+// triangles are stored in leaf order, so that a leaf is a
+// contiguous range of the triangle array.
+// build modes:
+// - SAH: binned SAH; the nodes near the root are binned by all
+//   workers, large subtrees are built as jobs
+// - LBVH: triangles sorted along a Morton curve, and split at
+//   the highest differing code bit; a much faster build, for
+//   interactive rebuilds, but a tree of lower quality
+// a subtree that could grow deeper than the traversal stack
+// allows is split at the median instead, which halves the
+// triangle count per level.
+// -----------------------------------------------------------
+#define BVH_BINS		16		// SAH candidate planes per axis: BVH_BINS - 1
+#define BVH_TRAVERSAL	1.0f	// SAH cost of a node visit, relative to a triangle test
+#define BVH_STACK		64		// traversal stack entries; bounds the tree depth
+#define BVH_PARALLEL	65536	// nodes with more triangles are binned by all workers
+#define BVH_TASK		4096	// subtrees with more triangles are built as jobs
+#define BVH_LEAF		4		// LBVH: maximum triangles per leaf
+class BVH
+{
+public:
+	enum { SAH = 0, LBVH };
+	struct Node
+	{
+		union { __m128 bmin4; struct { float minx, miny, minz; int leftFirst; }; };	// interior: first child; leaf: first triangle
+		union { __m128 bmax4; struct { float maxx, maxy, maxz; int count; }; };		// triangles; 0 for interior nodes
+		bool IsLeaf() const { return count > 0; }
+		float Area() const { const float ex = maxx - minx, ey = maxy - miny, ez = maxz - minz; return ex * ey + ey * ez + ez * ex; }
+	};
+	struct Tri { vec3 v0, e1, e2; };	// vertex and edges, for the Moller-Trumbore test
+	BVH() : node( 0 ), tri( 0 ), triMesh( 0 ), triIndex( 0 ), nodesUsed( 0 ), triCount( 0 ), mode( SAH ), maxDepth( 0 ), medianSplits( 0 ), buildTime( 0 ) {}
+	~BVH();
+	void Build( Scene* scene, int buildMode = SAH );
+	void Intersect( Ray& ray );
+	bool IntersectPacket( RayPacket& packet );
+	bool IsOccluded( Ray& ray );
+	float SAHCost();
+private:
+	BVH( const BVH& );
+	struct Bin { vec3 bmin, bmax; int count; };
+	void UpdateBounds( int nodeIdx );
+	float FindBestSplit( Node& n, int& axis, int& split, float& splitMin, float& splitScale );
+	int MakeChildren( int nodeIdx, int leftCount );
+	int SplitSAH( int nodeIdx );
+	int SplitMorton( int nodeIdx );
+	int SplitMedian( int nodeIdx );
+	void SortMorton();
+	void Subdivide( int nodeIdx, int depth );
+public:
+	Node* node;
+	Tri* tri;						// world-space triangles, in leaf order
+	Mesh** triMesh;					// source mesh and triangle index of each triangle
+	int* triIndex;
+	int nodesUsed, triCount;
+	int mode;						// SAH or LBVH
+	int maxDepth, medianSplits;		// deepest leaf (root: 0); nodes split at the median to bound the depth
+	float buildTime;				// in ms
+private:
+	// build state
+	uint* idx, *morton;				// triangle order; LBVH: the sorted codes
+	vec3* centroid, *tmin, *tmax;
+	std::atomic<int> nextNode;		// node pairs are allocated by concurrent subtree builds
+	std::atomic<int> deepest, medians;
+};
+
+// -----------------------------------------------------------
+// BVH8 class
+// 8-wide BVH, collapsed from a binary BVH: each node stores the
+// bounds of its (up to) 8 children in SoA layout, so that a ray
+// is tested against all of them at once with AVX2. a child is
+// an interior node, a leaf (a range of the triangle array of
+// the binary BVH, which remains the owner of the triangles) or
+// empty. the binary BVH must outlive the BVH8 built from it.
+// -----------------------------------------------------------
+#define BVH8_STACK		(8 * BVH_STACK)	// each level pushes at most 7 children
+class BVH8
+{
+public:
+	struct Node
+	{
+		union { __m256 bmin8[3]; float bmin[3][8]; };	// child bounds per axis
+		union { __m256 bmax8[3]; float bmax[3][8]; };
+		int child[8];				// interior: node index; leaf: first triangle
+		int count[8];				// leaf: triangles; interior: 0; empty: -1
+	};
+	BVH8() : node( 0 ), bvh( 0 ), nodesUsed( 0 ), buildTime( 0 ) {}
+	~BVH8();
+	void Build( const BVH& source );
+	void Intersect( Ray& ray );
+	bool IsOccluded( Ray& ray );
+private:
+	BVH8( const BVH8& );
+	void Collapse( int binaryIdx, int idx );
+public:
+	Node* node;
+	const BVH* bvh;					// source of the triangles
+	int nodesUsed;
+	float buildTime;				// in ms
 };
 
 // -----------------------------------------------------------
 // Raytracer class
-// to be build
+// ray queries against the scene the rasterizer draws; set the
+// scene before Init, which builds the BVH over its triangles.
+// the scene is not owned by the raytracer. Render traces the
+// primary rays of each screen tile as a packet, unless packets
+// is cleared; rays of packets that diverge are completed one
+// by one.
 // -----------------------------------------------------------
 class Raytracer
 {
 public:
 	// constructor / destructor
-	Raytracer() : scene( 0 ) {}
+	Raytracer() : scene( 0 ), screen( 0 ), packets( true ), packetCount( 0 ), divergedCount( 0 ) {}
 	~Raytracer();
 	// methods
-	void Init( Surface* screen );
+	void Init( Surface* screen, int bvhMode = BVH::SAH );
 	void FindNearest( Ray& ray );
 	bool IsOccluded( Ray& ray );
 	void Render( Camera& camera );
+	Ray PrimaryRay( Camera& camera, float x, float y );
+	void PrimaryPacket( Camera& camera, int x0, int y0, RayPacket& packet );
+	Pixel Shade( Ray& ray );
 	// data members
-	Scene* scene;	
+	Scene* scene;
+	Surface* screen;
+	BVH bvh;
+	BVH8 bvh8;						// built from bvh, if BVH8_TRACE is defined
+	bool packets;					// Render: trace tiles as packets
+	std::atomic<int> packetCount, divergedCount;	// Render statistics, cumulative
 };
 
-}; // namespace Tmpl8
\ No newline at end of file
+}; // namespace Tmpl8
@@ -9,14 +9,88 @@ void NotifyUser( char* s );
 char Surface::s_Font[51][5][6];	
 bool Surface::fontInitialized = false;
 
+// -----------------------------------------------------------
+// Palette pool implementation
+// -----------------------------------------------------------
+
+std::unordered_multimap<uint64, Pixel*> PalettePool::s_Index;
+std::unordered_map<Pixel*, int> PalettePool::s_RefCount;
+std::vector<Pixel*> PalettePool::s_Slabs, PalettePool::s_Free;
+int PalettePool::s_Sets = 0, PalettePool::s_Refs = 0;
+std::mutex PalettePool::s_Lock;
+
+// FNV-1a over the unscaled palette; the other levels are derived from it
+uint64 PalettePool::Hash(const Pixel* a_Base)
+{
+	uint64 hash = 14695981039346656037ull;
+	const unsigned char* p = (const unsigned char*)a_Base;
+	for (int i = 0; i < 256 * (int)sizeof(Pixel); i++) hash = (hash ^ p[i]) * 1099511628211ull;
+	return hash;
+}
+
+// generates the shading levels: level i scales the unscaled palette by
+// (i + PALETTE_LEVELS / 3) / (PALETTE_LEVELS * 3 / 4), so PALETTE_BASE is a copy
+void PalettePool::Expand(const Pixel* a_Base, Pixel* a_Set)
+{
+	const int scale = (PALETTE_LEVELS * 3) / 4, shift = PALETTE_LEVELS / 3;
+	for (int i = 0; i < PALETTE_LEVELS; i++) for (int j = 0; j < 256; j++)
+	{
+		const int r = min(255, (int)((a_Base[j] >> 16) & 255) * (i + shift) / scale);
+		const int g = min(255, (int)((a_Base[j] >> 8) & 255) * (i + shift) / scale);
+		const int b = min(255, (int)(a_Base[j] & 255) * (i + shift) / scale);
+		a_Set[i * 256 + j] = (r << 16) + (g << 8) + b;
+	}
+}
+
+// returns the pooled palette set for an unscaled palette, generating it if
+// it is not there yet
+Pixel* PalettePool::Acquire(const Pixel* a_Base)
+{
+	const uint64 hash = Hash(a_Base);
+	std::lock_guard<std::mutex> lock(s_Lock);
+	s_Refs++;
+	auto range = s_Index.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) if (!memcmp(it->second + PALETTE_BASE * 256, a_Base, 256 * sizeof(Pixel)))
+	{
+		s_RefCount[it->second]++;
+		return it->second;
+	}
+	if (s_Free.empty())
+	{
+		Pixel* slab = (Pixel*)MALLOC64(SLAB_SETS * SET_SIZE * sizeof(Pixel));
+		s_Slabs.push_back(slab);
+		for (int i = SLAB_SETS - 1; i >= 0; i--) s_Free.push_back(slab + i * SET_SIZE);
+	}
+	Pixel* set = s_Free.back();
+	s_Free.pop_back();
+	Expand(a_Base, set);
+	s_Index.insert(std::make_pair(hash, set));
+	s_RefCount[set] = 1, s_Sets++;
+	return set;
+}
+
+// drops a reference to a pooled palette set; unreferenced sets are recycled
+void PalettePool::Release(Pixel* a_Set)
+{
+	if (!a_Set) return;
+	std::lock_guard<std::mutex> lock(s_Lock);
+	s_Refs--;
+	if (--s_RefCount[a_Set] > 0) return;
+	s_RefCount.erase(a_Set);
+	auto range = s_Index.equal_range(Hash(a_Set + PALETTE_BASE * 256));
+	for (auto it = range.first; it != range.second; ++it) if (it->second == a_Set) { s_Index.erase(it); break; }
+	s_Free.push_back(a_Set), s_Sets--;
+}
+
 // -----------------------------------------------------------
 // Palettized surface class implementation
 // -----------------------------------------------------------
 
-Surface8::Surface8(char* a_File) :
-	m_Buffer(NULL),
-	m_Width(0), m_Height(0)
+Surface8::Surface8(char* a_File, bool a_Stream) :
+	m_Owned(0), m_Palettes(NULL), m_Map(new MappedFile()), m_Streamed(false),
+	m_Width(0), m_Height(0), m_MipLevels(0), m_Layout(LINEAR), m_Resident(0), m_Tail(0), m_Hash(0)
 {
+	memset(m_Mip, 0, sizeof(m_Mip));
 	FILE* f = fopen(a_File, "rb");
 	if (!f)
 	{
@@ -26,75 +100,425 @@ Surface8::Surface8(char* a_File) :
 		return;
 	}
 	else fclose(f);
-	LoadImage(a_File);
+	LoadImage(a_File, a_Stream);
+}
+
+// synthetic texture: random texels, grey palette; used for benchmarking
+Surface8::Surface8(int a_Width, int a_Height) :
+	m_Owned(0), m_Palettes(NULL), m_Map(NULL), m_Streamed(false),
+	m_Width(a_Width), m_Height(a_Height), m_Pitch(a_Width), m_Layout(LINEAR)
+{
+	memset(m_Mip, 0, sizeof(m_Mip));
+	AllocateMips();
+	for (int i = 0; i < a_Width * a_Height; i++) m_Mip[0][i] = (unsigned char)IRand(256);
+	for (int j = 0; j < 256; j++) m_Base[j] = j * 0x10101;
+	BuildMips();
+	m_Hash = HashContent();
+}
+
+// first use of the palette set; when several contexts draw the texture for the
+// first time at once, one set wins and the others return their reference
+Pixel* Surface8::AcquirePalettes()
+{
+	Pixel* set = PalettePool::Acquire(m_Base), *current = NULL;
+	if (m_Palettes.compare_exchange_strong(current, set)) return set;
+	PalettePool::Release(set);
+	return current;
+}
+
+// texel layout selected at import time: small textures stay linear
+static int PreferredLayout(int w, int h)
+{
+	const bool pow2 = ((w & (w - 1)) == 0) && ((h & (h - 1)) == 0);
+	return (pow2 && (w >= 64) && (h >= 64)) ? Surface8::TILED : Surface8::LINEAR;
 }
 
 Surface8::~Surface8()
 {
-	FREE64(m_Buffer);
+	FreeLevels();
+	PalettePool::Release(m_Palettes);
+	delete m_Map;
 }
 
-void Surface8::LoadImage(char* a_File)
+// .bin v2: this header, the unscaled palette, and the mip levels in the
+// texel layout of the header. the palette and each level start at a
+// 64-byte aligned offset, so that mapped levels are aligned like allocated ones.
+// hash is the content hash of the file (see HashContent); 0 in files written
+// before it was stored.
+struct BinHeader
+{
+	enum { MAGIC = 0x38584554 /* "TEX8" */, VERSION = 2 };
+	uint magic, version;
+	int width, height, levels, layout;
+	uint palette, offset[MAX_MIPS], unused;
+	uint64 hash;
+	uint reserved[32 - 10 - MAX_MIPS];	// pads the header to 128 bytes
+};
+
+// maps the .bin file of the texture, or upgrades an older .bin, or imports
+// the image and writes the .bin; a streamed texture only keeps its coarse
+// tail (see TextureResidency)
+void Surface8::LoadImage(char* a_File, bool a_Stream)
 {
 	char binFile[1024], *lastDot = binFile + strlen(a_File), *pos = binFile;
 	strcpy(binFile, a_File);
 	while (strstr(pos + 1, ".")) lastDot = pos = strstr(pos + 1, ".");
 	*lastDot = 0;
 	strcat(lastDot, ".bin");
-	FILE* f = fopen(binFile, "rb");
-	if (f)
-	{
-		fread(&m_Width, 4, 1, f);
-		fread(&m_Height, 4, 1, f);
-		m_Buffer = (unsigned char*)MALLOC64(m_Width * m_Height);
-		fread(m_Buffer, m_Width * m_Height, 1, f);
-		for (int i = 0; i < PALETTE_LEVELS; i++)
+	if (!MapBin(binFile))
+	{
+		if (!LoadLegacy(binFile))
 		{
-			palette[i] = new Pixel[256];
-			fread(palette[i], 256 * sizeof(Pixel), 1, f);
+			FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
+			fif = FreeImage_GetFileType(a_File, 0);
+			if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename(a_File);
+			FIBITMAP* tmp = FreeImage_Load(fif, a_File);
+			FIBITMAP* t32 = FreeImage_ConvertTo24Bits(tmp);
+			FIBITMAP* dib = FreeImage_ColorQuantize(t32, FIQ_NNQUANT); // FIQ_WUQUANT or FIQ_NNQUANT
+			FreeImage_Unload(tmp);
+			FreeImage_Unload(t32);
+			m_Width = m_Pitch = FreeImage_GetWidth(dib);
+			m_Height = FreeImage_GetHeight(dib);
+			AllocateMips();
+			for (int y = 0; y < m_Height; y++)
+			{
+				unsigned char* line = FreeImage_GetScanLine(dib, m_Height - 1 - y);
+				memcpy(m_Mip[0] + y * m_Pitch, line, m_Width);
+			}
+			RGBQUAD* pal = FreeImage_GetPalette(dib);
+			for (int j = 0; j < 256; j++) m_Base[j] = (pal[j].rgbRed << 16) + (pal[j].rgbGreen << 8) + pal[j].rgbBlue;
+			FreeImage_Unload(dib);
+			BuildMips();
+			SetLayout(PreferredLayout(m_Width, m_Height));
 		}
+		// write the current format, and use the file from now on; if that
+		// fails, the texture simply keeps its allocated levels
+		Save(binFile);
+		MapBin(binFile);
+	}
+	if (a_Stream && m_Map->data)
+	{
+		m_Streamed = true;
+		while (m_Resident < m_Tail) Evict();
+	}
+#ifdef COMPRESS_TEXTURES
+	if (m_Layout == TILED) SetLayout(BLOCK4);
+#endif
+}
+
+// maps a .bin v2 file and points the levels into it, without copying texels;
+// returns false if the file is missing, truncated or of another version
+bool Surface8::MapBin(char* a_File)
+{
+	if (!m_Map->Open(a_File)) return false;
+	const BinHeader* h = (const BinHeader*)m_Map->data;
+	bool valid = (m_Map->size >= sizeof(BinHeader)) && (h->magic == BinHeader::MAGIC) && (h->version == BinHeader::VERSION);
+	valid = valid && (h->width > 0) && (h->height > 0) && (h->width <= 32768) && (h->height <= 32768);
+	valid = valid && ((h->layout == LINEAR) || (h->layout == TILED)) && (h->palette + 256 * sizeof(Pixel) <= m_Map->size);
+	if (valid)
+	{
+		m_Width = m_Pitch = h->width, m_Height = h->height, m_Layout = h->layout;
+		InitMips();
+		valid = (h->levels == m_MipLevels);
+		for (int i = 0; valid && (i < m_MipLevels); i++)
+			valid = !(h->offset[i] & 63) && ((size_t)h->offset[i] + GetLevelSize(i) <= m_Map->size);
+	}
+	if (!valid)
+	{
+		m_Map->Close();
+		return false;
+	}
+	memcpy(m_Base, m_Map->data + h->palette, sizeof(m_Base));
+	for (int i = 0; i < m_MipLevels; i++) SetLevel(i, (unsigned char*)m_Map->data + h->offset[i], false);
+	m_Resident = 0;
+	m_Hash = h->hash ? h->hash : HashContent();
+	return true;
+}
+
+// reads a .bin file written before v2: w, h, level 0, the 32 scaled palettes,
+// and, if present, the level count, levels 1..n-1 and the texel layout
+bool Surface8::LoadLegacy(char* a_File)
+{
+	FILE* f = fopen(a_File, "rb");
+	if (!f) return false;
+	const bool valid = (fread(&m_Width, 4, 1, f) == 1) && (fread(&m_Height, 4, 1, f) == 1) &&
+		(m_Width > 0) && (m_Height > 0) && (m_Width <= 32768) && (m_Height <= 32768);
+	if (valid) m_Pitch = m_Width, AllocateMips();
+	if (!valid || (fread(m_Mip[0], m_Width * m_Height, 1, f) != 1) || fseek(f, PALETTE_BASE * 256 * sizeof(Pixel), SEEK_CUR) ||
+		(fread(m_Base, sizeof(m_Base), 1, f) != 1) || fseek(f, (PALETTE_LEVELS - PALETTE_BASE - 1) * 256 * sizeof(Pixel), SEEK_CUR))
+	{
 		fclose(f);
+		FreeLevels();
+		return false;
+	}
+	int levels = 0, layout = LINEAR;
+	const bool hasMips = (fread(&levels, 4, 1, f) == 1) && (levels == m_MipLevels);
+	if (hasMips)
+	{
+		for (int i = 1; i < m_MipLevels; i++) fread(m_Mip[i], GetLevelSize(i), 1, f);
+		if (fread(&layout, 4, 1, f) != 1) layout = LINEAR;
 	}
-	else
-	{
-		FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
-		fif = FreeImage_GetFileType(a_File, 0);
-		if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename(a_File);
-		FIBITMAP* tmp = FreeImage_Load(fif, a_File);
-		FIBITMAP* t32 = FreeImage_ConvertTo24Bits(tmp);
-		FIBITMAP* dib = FreeImage_ColorQuantize(t32, FIQ_NNQUANT); // FIQ_WUQUANT or FIQ_NNQUANT
-		FreeImage_Unload(tmp);
-		FreeImage_Unload(t32);
-		unsigned char* bits = FreeImage_GetBits(dib);
-		m_Width = m_Pitch = FreeImage_GetWidth(dib);
-		m_Height = FreeImage_GetHeight(dib);
-		m_Buffer = (unsigned char*)MALLOC64(m_Width * m_Height);
-		for (int y = 0; y < m_Height; y++)
+	fclose(f);
+	m_Layout = layout;
+	if (!hasMips) BuildMips();
+	SetLayout(PreferredLayout(m_Width, m_Height));
+	return true;
+}
+
+// writes a .bin v2 file; see BinHeader. the content hash is computed here,
+// so that textures loaded from the file later do not need to hash their texels
+void Surface8::Save(char* a_File)
+{
+	m_Hash = HashContent();
+	FILE* f = fopen(a_File, "wb");
+	if (!f) return;
+	BinHeader h;
+	memset(&h, 0, sizeof(h));
+	h.magic = BinHeader::MAGIC, h.version = BinHeader::VERSION;
+	h.width = m_Width, h.height = m_Height, h.levels = m_MipLevels, h.layout = m_Layout;
+	h.palette = sizeof(BinHeader);
+	h.hash = m_Hash;
+	uint offset = h.palette + ((sizeof(m_Base) + 63) & ~63);
+	for (int i = 0; i < m_MipLevels; i++) h.offset[i] = offset, offset += (GetLevelSize(i) + 63) & ~63;
+	static const unsigned char zero[64] = { 0 };
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(m_Base, sizeof(m_Base), 1, f);
+	for (int i = 0; i < m_MipLevels; i++)
+	{
+		fwrite(m_Mip[i], GetLevelSize(i), 1, f);
+		fwrite(zero, (64 - (GetLevelSize(i) & 63)) & 63, 1, f);
+	}
+	fclose(f);
+}
+
+// computes the dimensions of the mip chain and the first level of the
+// resident tail
+void Surface8::InitMips()
+{
+	for (m_MipLevels = 0; m_MipLevels < MAX_MIPS; m_MipLevels++)
+		if ((GetWidth(m_MipLevels) == 1) && (GetHeight(m_MipLevels) == 1)) { m_MipLevels++; break; }
+	for (m_Tail = 0; m_Tail < m_MipLevels - 1; m_Tail++)
+		if ((GetWidth(m_Tail) <= MIP_TAIL) && (GetHeight(m_Tail) <= MIP_TAIL)) break;
+	m_Resident = m_MipLevels;
+}
+
+// allocates the full mip chain; each level has its own buffer, so that
+// levels can be released individually
+void Surface8::AllocateMips()
+{
+	InitMips();
+	for (int i = 0; i < m_MipLevels; i++) SetLevel(i, (unsigned char*)MALLOC64(GetLevelSize(i)), true);
+	m_Resident = 0;
+}
+
+void Surface8::FreeLevels()
+{
+	for (int i = 0; i < MAX_MIPS; i++) SetLevel(i, NULL, false);
+}
+
+// replaces the texels of a level; allocated texels are freed, mapped ones
+// stay in the file
+void Surface8::SetLevel(int a_Level, unsigned char* a_Data, bool a_Owned)
+{
+	if (m_Owned & (1 << a_Level)) FREE64(m_Mip[a_Level]);
+	m_Mip[a_Level] = a_Data;
+	if (a_Owned) m_Owned |= 1 << a_Level; else m_Owned &= ~(1 << a_Level);
+}
+
+// mapped levels are read-only; copy before modifying texels in place
+void Surface8::MakeOwned(int a_Level)
+{
+	if (!m_Mip[a_Level] || (m_Owned & (1 << a_Level))) return;
+	unsigned char* copy = (unsigned char*)MALLOC64(GetLevelSize(a_Level));
+	memcpy(copy, m_Mip[a_Level], GetLevelSize(a_Level));
+	SetLevel(a_Level, copy, true);
+}
+
+// residency: makes the next finer level available again. the file pages of
+// the level are read ahead; block levels are encoded on arrival, after which
+// their file pages are no longer needed.
+bool Surface8::StreamIn()
+{
+	if (!m_Streamed || (m_Resident == 0)) return false;
+	const BinHeader* h = (const BinHeader*)m_Map->data;
+	m_Resident--;
+	m_Map->Prefetch(h->offset[m_Resident], GetLevelSize(m_Resident));
+	SetLevel(m_Resident, (unsigned char*)m_Map->data + h->offset[m_Resident], false);
+	if (GetLevelLayout(m_Resident) == BLOCK4)
+	{
+		EncodeBlock4(m_Resident);
+		m_Map->Discard(h->offset[m_Resident], GetLevelSize(m_Resident));
+	}
+	return true;
+}
+
+// residency: releases the finest resident level, and drops its file pages
+// from memory; the tail stays resident
+bool Surface8::Evict()
+{
+	if (!m_Streamed || (m_Resident >= m_Tail)) return false;
+	const BinHeader* h = (const BinHeader*)m_Map->data;
+	m_Map->Discard(h->offset[m_Resident], GetLevelSize(m_Resident));
+	SetLevel(m_Resident++, NULL, false);
+	return true;
+}
+
+// hash of the dimensions, the unscaled palette and the texels of all levels, as
+// stored in the .bin file; computed when the file is written (never 0, which marks
+// files without a stored hash)
+uint64 Surface8::HashContent()
+{
+	uint64 hash = 14695981039346656037ull;
+	const int header[3] = { m_Width, m_Height, m_Layout };
+	const unsigned char* p = (const unsigned char*)header;
+	for (int i = 0; i < (int)sizeof(header); i++) hash = (hash ^ p[i]) * 1099511628211ull;
+	p = (const unsigned char*)m_Base;
+	for (int i = 0; i < (int)sizeof(m_Base); i++) hash = (hash ^ p[i]) * 1099511628211ull;
+	for (int l = 0; l < m_MipLevels; l++)
+		for (int i = 0, n = GetLevelBytes(l); i < n; i++) hash = (hash ^ m_Mip[l][i]) * 1099511628211ull;
+	return hash ? hash : 1;
+}
+
+// full comparison of the resident data, to confirm a content hash match
+bool Surface8::SameContent(Surface8* a_Other)
+{
+	if ((m_Width != a_Other->m_Width) || (m_Height != a_Other->m_Height) || (m_Layout != a_Other->m_Layout)) return false;
+	if (memcmp(m_Base, a_Other->m_Base, sizeof(m_Base)) || (m_Resident != a_Other->m_Resident)) return false;
+	for (int l = m_Resident; l < m_MipLevels; l++) if (memcmp(m_Mip[l], a_Other->m_Mip[l], GetLevelBytes(l))) return false;
+	return true;
+}
+
+// texel memory, mapped or allocated; palettes are shared, see PalettePool::GetBytes
+int Surface8::GetResidentBytes()
+{
+	int bytes = 0;
+	for (int i = m_Resident; i < m_MipLevels; i++) bytes += GetLevelBytes(i);
+	return bytes;
+}
+
+// converts the texel data of all levels that are large enough for tiling
+// between the linear, the tiled and the 4-bit block layout; the block
+// layout requires power-of-two dimensions
+void Surface8::SetLayout(int a_Layout)
+{
+	if (a_Layout == m_Layout) return;
+	if (m_Layout == BLOCK4)
+	{
+		for (int l = 0; l < m_MipLevels; l++) if (m_Mip[l] && (GetLevelLayout(l) == BLOCK4)) DecodeBlock4(l);
+		m_Layout = TILED;
+		SetLayout(a_Layout);
+		return;
+	}
+	if (a_Layout == BLOCK4)
+	{
+		if ((m_Width & (m_Width - 1)) || (m_Height & (m_Height - 1))) return;
+		SetLayout(TILED);
+		m_Layout = BLOCK4;
+		for (int l = 0; l < m_MipLevels; l++) if (m_Mip[l] && (GetLevelLayout(l) == BLOCK4)) EncodeBlock4(l);
+		return;
+	}
+	unsigned char* tmp = (unsigned char*)MALLOC64(m_Width * m_Height);
+	for (int l = 0; l < m_MipLevels; l++)
+	{
+		const int w = GetWidth(l), h = GetHeight(l), shift = GetWidthShift(l);
+		if ((w < TEXEL_TILE) || (h < TEXEL_TILE)) break;
+		if (!m_Mip[l]) continue;
+		MakeOwned(l);
+		memcpy(tmp, m_Mip[l], w * h);
+		for (int v = 0; v < h; v++) for (int u = 0; u < w; u++)
 		{
-			unsigned char* line = FreeImage_GetScanLine(dib, m_Height - 1 - y);
-			memcpy(m_Buffer + y * m_Pitch, line, m_Width);
+			if (a_Layout == TILED) m_Mip[l][TiledAddress(u, v, shift)] = tmp[u + v * w];
+			else m_Mip[l][u + v * w] = tmp[TiledAddress(u, v, shift)];
 		}
-		RGBQUAD* pal = FreeImage_GetPalette(dib);
-		for (int i = 0; i < PALETTE_LEVELS; i++)
+	}
+	FREE64(tmp);
+	m_Layout = a_Layout;
+}
+
+// converts a tiled level to the 4-bit block layout. the sub-palette of a tile
+// holds its 16 most frequent palette indices; other texels map to the nearest
+// sub-palette entry in rgb. lossless for tiles with up to 16 distinct indices.
+void Surface8::EncodeBlock4(int a_Level)
+{
+	const int size = GetLevelSize(a_Level), tiles = size / 64;
+	unsigned char* block = (unsigned char*)MALLOC64(size / 2 + tiles * 16);
+	unsigned char* idx = block, *sub = block + size / 2;
+	const unsigned char* src = m_Mip[a_Level];
+	const Pixel* pal = m_Base;
+	memset(idx, 0, size / 2);
+	for (int t = 0; t < tiles; t++, src += 64, idx += 32, sub += 16)
+	{
+		// distinct indices of the tile, most frequent first
+		int count[256], distinct = 0;
+		unsigned char used[64], slot[256];
+		memset(count, 0, sizeof(count));
+		for (int i = 0; i < 64; i++) if (!count[src[i]]++) used[distinct++] = src[i];
+		std::sort(used, used + distinct, [&count](unsigned char a, unsigned char b) { return count[a] > count[b]; });
+		const int n = MIN(distinct, 16);
+		for (int i = 0; i < 16; i++) sub[i] = used[MIN(i, n - 1)];
+		for (int i = 0; i < distinct; i++)
 		{
-			palette[i] = new Pixel[256];
-			int scale = (PALETTE_LEVELS * 3) / 4, shift = PALETTE_LEVELS / 3;
-			for (int j = 0; j < 256; j++)
+			int best = 0, bestDist = 1 << 30;
+			if (i < n) best = i; else for (int j = 0; j < n; j++)
 			{
-				int r = min(255, (pal[j].rgbRed * (i + shift)) / scale);
-				int g = min(255, (pal[j].rgbGreen * (i + shift)) / scale);
-				int b = min(255, (pal[j].rgbBlue * (i + shift)) / scale);
-				palette[i][j] = (r << 16) + (g << 8) + b;
+				const Pixel a = pal[used[i]], b = pal[sub[j]];
+				const int dr = (int)((a >> 16) & 255) - (int)((b >> 16) & 255);
+				const int dg = (int)((a >> 8) & 255) - (int)((b >> 8) & 255), db = (int)(a & 255) - (int)(b & 255);
+				const int dist = dr * dr + dg * dg + db * db;
+				if (dist < bestDist) bestDist = dist, best = j;
 			}
+			slot[used[i]] = (unsigned char)best;
 		}
-		FreeImage_Unload(dib);
-		FILE* f = fopen(binFile, "wb");
-		fwrite(&m_Width, 4, 1, f);
-		fwrite(&m_Height, 4, 1, f);
-		fwrite(m_Buffer, m_Width * m_Height, 1, f);
-		for (int i = 0; i < PALETTE_LEVELS; i++) fwrite(palette[i], 256 * sizeof(Pixel), 1, f);
-		fclose(f);
+		for (int i = 0; i < 64; i++) idx[i >> 1] |= slot[src[i]] << ((i & 1) << 2);
 	}
+	SetLevel(a_Level, block, true);
+}
+
+// expands a 4-bit block level back to tiled palette indices
+void Surface8::DecodeBlock4(int a_Level)
+{
+	const int size = GetLevelSize(a_Level);
+	unsigned char* tiled = (unsigned char*)MALLOC64(size);
+	for (int i = 0; i < size; i++) tiled[i] = (unsigned char)Block4Index(m_Mip[a_Level], GetSubPalettes(a_Level), i);
+	SetLevel(a_Level, tiled, true);
+}
+
+// builds the mip chain by box filtering in rgb space, using the unscaled
+// palette, and mapping the result back to the nearest palette entry;
+// expects linear texel data
+void Surface8::BuildMips()
+{
+	// inverse palette: nearest palette entry for each 15-bit rgb color
+	const Pixel* pal = m_Base;
+	unsigned char* inverse = new unsigned char[32768];
+	for (int i = 0; i < 32768; i++)
+	{
+		const int r = ((i >> 10) << 3) + 4, g = (((i >> 5) & 31) << 3) + 4, b = ((i & 31) << 3) + 4;
+		int best = 0, bestDist = 1 << 30;
+		for (int j = 0; j < 256; j++)
+		{
+			const int dr = r - (int)((pal[j] >> 16) & 255), dg = g - (int)((pal[j] >> 8) & 255), db = b - (int)(pal[j] & 255);
+			const int dist = dr * dr + dg * dg + db * db;
+			if (dist < bestDist) bestDist = dist, best = j;
+		}
+		inverse[i] = (unsigned char)best;
+	}
+	for (int l = 1; l < m_MipLevels; l++)
+	{
+		const int w = GetWidth(l), h = GetHeight(l), pw = GetWidth(l - 1), ph = GetHeight(l - 1);
+		const unsigned char* src = m_Mip[l - 1];
+		for (int y = 0; y < h; y++) for (int x = 0; x < w; x++)
+		{
+			const int x0 = MIN(x * 2, pw - 1), x1 = MIN(x * 2 + 1, pw - 1);
+			const int y0 = MIN(y * 2, ph - 1), y1 = MIN(y * 2 + 1, ph - 1);
+			const Pixel c[4] = { pal[src[x0 + y0 * pw]], pal[src[x1 + y0 * pw]], pal[src[x0 + y1 * pw]], pal[src[x1 + y1 * pw]] };
+			int r = 0, g = 0, b = 0;
+			for (int i = 0; i < 4; i++) r += (c[i] >> 16) & 255, g += (c[i] >> 8) & 255, b += c[i] & 255;
+			r = (r + 2) >> 2, g = (g + 2) >> 2, b = (b + 2) >> 2;
+			m_Mip[l][x + y * w] = inverse[((r >> 3) << 10) + ((g >> 3) << 5) + (b >> 3)];
+		}
+	}
+	delete[] inverse;
 }
 
 // -----------------------------------------------------------
@@ -166,8 +590,7 @@ Surface::~Surface()
 
 void Surface::Clear( Pixel a_Color )
 {
-	int s = m_Width * m_Height;
-	for ( int i = 0; i < s; i++ ) m_Buffer[i] = a_Color;
+	parallel_for( 0, m_Width * m_Height, 1 << 16, [this, a_Color]( int first, int last ) { for ( int i = first; i < last; i++ ) m_Buffer[i] = a_Color; } );
 }
 
 void Surface::Centre( char* a_String, int y1, Pixel color )
@@ -199,11 +622,11 @@ void Surface::Print( char* a_String, int x1, int y1, Pixel color )
 void Surface::Resize( Surface* a_Orig )
 {
 	Pixel* src = a_Orig->GetBuffer(), *dst = m_Buffer;
-	int u, v, owidth = a_Orig->GetWidth(), oheight = a_Orig->GetHeight();
+	int owidth = a_Orig->GetWidth(), oheight = a_Orig->GetHeight();
 	int dx = (owidth << 10) / m_Width, dy = (oheight << 10) / m_Height;
-	for ( v = 0; v < m_Height; v++ )
+	parallel_for( 0, m_Height, 16, [&]( int first, int last )
 	{
-		for ( u = 0; u < m_Width; u++ )
+		for ( int v = first; v < last; v++ ) for ( int u = 0; u < m_Width; u++ )
 		{
 			int su = u * dx, sv = v * dy;
 			Pixel* s = src + (su >> 10) + (sv >> 10) * owidth;
@@ -220,7 +643,7 @@ void Surface::Resize( Surface* a_Orig )
 			unsigned int b = (((p1 & BLUEMASK) * w1 + (p2 & BLUEMASK) * w2 + (p3 & BLUEMASK) * w3 + (p4 & BLUEMASK) * w4) >> 8) & BLUEMASK;
 			*(dst + u + v * m_Pitch) = (Pixel)(r + g + b);
 		}
-	}
+	} );
 }
 
 #define OUTCODE(x,y) (((x)<xmin)?1:(((x)>xmax)?2:0))+(((y)<ymin)?4:(((y)>ymax)?8:0))
@@ -10,6 +10,10 @@ namespace Tmpl8 {
 #define BLUEMASK (0x0000ff)
 
 #define PALETTE_LEVELS	32
+#define PALETTE_BASE	((PALETTE_LEVELS * 3) / 4 - PALETTE_LEVELS / 3)	// unscaled palette
+#define MAX_MIPS		16
+#define TEXEL_TILE		8		// tiled layout: 8x8 texels, one cache line per tile
+#define MIP_TAIL		64		// streamed textures: levels up to 64x64 stay resident
 
 typedef unsigned int Pixel; // unsigned int is assumed to be 32-bit, which seems a safe assumption.
 
@@ -36,20 +40,91 @@ inline Pixel SubBlend( Pixel a_Color1, Pixel a_Color2 )
 	return (Pixel)(red + green + blue);
 }
 
+// shared palette storage: a palette set is the PALETTE_LEVELS pre-scaled
+// palettes of a texture, stored contiguously; identical sets (found by the hash
+// of the unscaled palette) are stored once and reference counted. the scaled
+// levels are generated when a set is first acquired. sets live in 64-byte
+// aligned slabs, so that a shading level is an offset into the pool. the pool
+// is shared by all scenes, so acquiring and releasing sets is serialized.
+class PalettePool
+{
+public:
+	enum { SET_SIZE = PALETTE_LEVELS * 256, SLAB_SETS = 8 };
+	static Pixel* Acquire(const Pixel* a_Base);
+	static void Release(Pixel* a_Set);
+	static int GetSets() { return s_Sets; }
+	static int GetRefs() { return s_Refs; }
+	static int GetBytes() { return (int)s_Slabs.size() * SLAB_SETS * SET_SIZE * sizeof(Pixel); }
+private:
+	static uint64 Hash(const Pixel* a_Base);
+	static void Expand(const Pixel* a_Base, Pixel* a_Set);
+	static std::unordered_multimap<uint64, Pixel*> s_Index;
+	static std::unordered_map<Pixel*, int> s_RefCount;
+	static std::vector<Pixel*> s_Slabs, s_Free;
+	static int s_Sets, s_Refs;
+	static std::mutex s_Lock;
+};
+
 class Surface8
 {
 public:
-	Surface8(char* a_File);
+	enum { LINEAR = 0, TILED = 1, BLOCK4 = 2 };	// texel layouts
+	Surface8(char* a_File, bool a_Stream = false);
+	Surface8(int a_Width, int a_Height);
 	~Surface8();
-	unsigned char* GetBuffer() { return m_Buffer; }
-	Pixel* GetPalette(int a_Idx) { return palette[a_Idx]; }
-	int GetWidth() { return m_Width; }
-	int GetHeight() { return m_Height; }
-	void LoadImage(char* a_File);
+	unsigned char* GetBuffer(int a_Level = 0) { return m_Mip[a_Level]; }
+	// the palette set is acquired on first use; textures that are never drawn only hold the base palette
+	Pixel* GetPalette(int a_Idx) { Pixel* p = m_Palettes.load(std::memory_order_acquire); return (p ? p : AcquirePalettes()) + a_Idx * 256; }
+	const Pixel* GetBasePalette() { return m_Base; }
+	int GetWidth(int a_Level = 0) { return MAX(1, m_Width >> a_Level); }
+	int GetHeight(int a_Level = 0) { return MAX(1, m_Height >> a_Level); }
+	int GetMipLevels() { return m_MipLevels; }
+	int GetWidthShift(int a_Level = 0) { int s = 0; while ((1 << s) < GetWidth(a_Level)) s++; return s; }
+	int GetLayout() { return m_Layout; }
+	int GetLevelLayout(int a_Level) { return ((GetWidth(a_Level) >= TEXEL_TILE) && (GetHeight(a_Level) >= TEXEL_TILE)) ? m_Layout : LINEAR; }
+	bool IsTiled(int a_Level) { return GetLevelLayout(a_Level) == TILED; }
+	static int TiledAddress(int u, int v, int a_WidthShift) { return ((v & ~7) << a_WidthShift) + ((u & ~7) << 3) + ((v & 7) << 3) + (u & 7); }
+	// 4-bit block layout: per 8x8 tile, 4-bit indices into a 16-entry sub-palette of palette
+	// indices; the sub-palettes of a level follow its index plane. a_Addr is the tiled address.
+	unsigned char* GetSubPalettes(int a_Level) { return m_Mip[a_Level] + GetLevelSize(a_Level) / 2; }
+	static int Block4Index(const unsigned char* a_Src, const unsigned char* a_Sub, int a_Addr) { return a_Sub[((a_Addr >> 6) << 4) + ((a_Src[a_Addr >> 1] >> ((a_Addr & 1) << 2)) & 15)]; }
+	void SetLayout(int a_Layout);
+	void LoadImage(char* a_File, bool a_Stream = false);
+	// residency: levels finer than m_Resident are not in memory; the rasterizer
+	// samples the finest resident level instead (see TextureResidency)
+	int GetResidentLevel() { return m_Resident; }
+	int GetTailLevel() { return m_Tail; }
+	int GetLevelSize(int a_Level) { return GetWidth(a_Level) * GetHeight(a_Level); }
+	int GetLevelBytes(int a_Level) { return (GetLevelLayout(a_Level) == BLOCK4) ? (GetLevelSize(a_Level) * 3) / 4 : GetLevelSize(a_Level); }
+	int GetResidentBytes();
+	uint64 ContentHash() { return m_Hash; }
+	bool SameContent(Surface8* a_Other);
+	bool IsStreamed() { return m_Streamed; }
+	bool StreamIn();
+	bool Evict();
 private:
-	unsigned char* m_Buffer;
-	Pixel* palette[PALETTE_LEVELS];
-	int m_Width, m_Height, m_Pitch;
+	Pixel* AcquirePalettes();
+	void InitMips();
+	void AllocateMips();
+	void BuildMips();
+	void FreeLevels();
+	void SetLevel(int a_Level, unsigned char* a_Data, bool a_Owned);
+	void MakeOwned(int a_Level);
+	bool MapBin(char* a_File);
+	bool LoadLegacy(char* a_File);
+	void EncodeBlock4(int a_Level);
+	void DecodeBlock4(int a_Level);
+	void Save(char* a_File);
+	uint64 HashContent();
+	unsigned char* m_Mip[MAX_MIPS];	// levels point into the mapped .bin, unless owned
+	uint m_Owned;					// bit per level: texels were allocated, not mapped
+	Pixel m_Base[256];				// unscaled palette (PALETTE_BASE)
+	std::atomic<Pixel*> m_Palettes;	// palette set, shared through the PalettePool
+	MappedFile* m_Map;				// .bin v2 file
+	bool m_Streamed;
+	int m_Width, m_Height, m_Pitch, m_MipLevels, m_Layout;
+	int m_Resident, m_Tail;
+	uint64 m_Hash;					// content hash, from the .bin header (see Save)
 };
 
 class Surface
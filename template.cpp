@@ -92,6 +92,83 @@ mat4 inverse( mat4 m )
 	return m;
 }
 
+// Memory mapped files
+// ----------------------------------------------------------------------------
+bool MappedFile::Open( const char* file )
+{
+	Close();
+#ifdef _WIN32
+	HANDLE f = CreateFileA( file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (f == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx( f, &fileSize ) && (fileSize.QuadPart > 0)) handle = CreateFileMappingA( f, NULL, PAGE_READONLY, 0, 0, NULL );
+	CloseHandle( f );
+	if (!handle) return false;
+	data = (const unsigned char*)MapViewOfFile( handle, FILE_MAP_READ, 0, 0, 0 );
+	size = (size_t)fileSize.QuadPart;
+#else
+	int f = open( file, O_RDONLY );
+	if (f < 0) return false;
+	struct stat info;
+	if (!fstat( f, &info ) && (info.st_size > 0))
+	{
+		void* view = mmap( NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, f, 0 );
+		if (view != MAP_FAILED) data = (const unsigned char*)view, size = (size_t)info.st_size;
+	}
+	close( f );
+#endif
+	if (!data) Close();
+	return data != 0;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (data) UnmapViewOfFile( data );
+	if (handle) CloseHandle( handle );
+#else
+	if (data) munmap( (void*)data, size );
+#endif
+	data = 0, size = 0, handle = 0;
+}
+
+static size_t PageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf( _SC_PAGESIZE );
+#endif
+}
+
+void MappedFile::Prefetch( size_t offset, size_t bytes ) const
+{
+	if (!data || (offset >= size)) return;
+	const size_t first = offset & ~(PageSize() - 1), last = (offset + bytes < size) ? (offset + bytes) : size;
+#ifdef _WIN32
+	WIN32_MEMORY_RANGE_ENTRY range = { (void*)(data + first), last - first };
+	PrefetchVirtualMemory( GetCurrentProcess(), 1, &range, 0 );
+#else
+	madvise( (void*)(data + first), last - first, MADV_WILLNEED );
+#endif
+}
+
+// only whole pages are discarded: the partial pages at either end hold neighbouring data
+void MappedFile::Discard( size_t offset, size_t bytes ) const
+{
+	if (!data || (offset >= size)) return;
+	const size_t page = PageSize(), first = (offset + page - 1) & ~(page - 1);
+	const size_t last = ((offset + bytes < size) ? (offset + bytes) : size) & ~(page - 1);
+	if (first >= last) return;
+#ifdef _WIN32
+	VirtualUnlock( (void*)(data + first), last - first ); // on pages that are not locked: removes them from the working set
+#else
+	madvise( (void*)(data + first), last - first, MADV_DONTNEED );
+#endif
+}
+
 void NotifyUser( char* s )
 {
 	HWND hApp = FindWindow( NULL, TEMPLATE_VERSION );
@@ -242,6 +319,127 @@ void swap()
 
 #endif
 
+// -----------------------------------------------------------
+// FrameRing
+// pixel buffers that cycle between the render thread, which
+// draws a frame into a free buffer, and the main thread, which
+// uploads finished frames to the SDL texture and presents
+// them. a buffer is free again once it has been uploaded, so
+// rendering overlaps with the vsync wait of the present; the
+// render thread runs up to FRAME_BUFFERS - 1 frames ahead.
+// -----------------------------------------------------------
+class FrameRing
+{
+public:
+	FrameRing( int count, int pixels ) : quit( false )
+	{
+		for( int i = 0; i < count; i++ ) buffers.push_back( (Pixel*)MALLOC64( pixels * sizeof( Pixel ) ) );
+		idle = buffers;
+	}
+	~FrameRing() { for( uint i = 0; i < buffers.size(); i++ ) FREE64( buffers[i] ); }
+	Pixel* GetBuffer( int i ) { return buffers[i]; }
+	// render thread: waits for a free buffer; returns 0 on shutdown
+	Pixel* AcquireFree()
+	{
+		unique_lock<mutex> lock( guard );
+		changed.wait( lock, [this]() { return quit || !idle.empty(); } );
+		if (quit) return 0;
+		Pixel* buffer = idle.back();
+		idle.pop_back();
+		return buffer;
+	}
+	void Submit( Pixel* buffer )
+	{
+		{ lock_guard<mutex> lock( guard ); ready.push_back( buffer ); }
+		changed.notify_all();
+	}
+	// main thread: oldest finished frame, or 0 if none arrives in time
+	Pixel* AcquireReady( int ms )
+	{
+		unique_lock<mutex> lock( guard );
+		if (!changed.wait_for( lock, chrono::milliseconds( ms ), [this]() { return quit || !ready.empty(); } ) || quit) return 0;
+		Pixel* buffer = ready.front();
+		ready.erase( ready.begin() );
+		return buffer;
+	}
+	void Release( Pixel* buffer )
+	{
+		{ lock_guard<mutex> lock( guard ); idle.push_back( buffer ); }
+		changed.notify_all();
+	}
+	void Shutdown()
+	{
+		{ lock_guard<mutex> lock( guard ); quit = true; }
+		changed.notify_all();
+	}
+private:
+	vector<Pixel*> buffers, idle, ready;
+	mutex guard;
+	condition_variable changed;
+	bool quit;
+};
+
+// input events are collected by the main thread, and handed to the game on the render thread
+static mutex eventLock;
+static vector<SDL_Event> events;
+
+static bool IsQuit( SDL_Event& event )
+{
+	return (event.type == SDL_QUIT) || ((event.type == SDL_KEYDOWN) && (event.key.keysym.sym == SDLK_ESCAPE));
+}
+
+static void HandleEvent( SDL_Event& event )
+{
+	switch (event.type)
+	{
+	case SDL_KEYDOWN:
+		// find other keys here: http://sdl.beuc.net/sdl.wiki/SDLKey
+		game->KeyDown( event.key.keysym.scancode );
+		break;
+	case SDL_KEYUP:
+		game->KeyUp( event.key.keysym.scancode );
+		break;
+	case SDL_MOUSEMOTION:
+		game->MouseMove( event.motion.xrel, event.motion.yrel );
+		break;
+	case SDL_MOUSEBUTTONUP:
+		game->MouseUp( event.button.button );
+		break;
+	case SDL_MOUSEBUTTONDOWN:
+		game->MouseDown( event.button.button );
+		break;
+	default:
+		break;
+	}
+}
+
+// render thread: initializes the game, then draws frames into free ring
+// buffers; all Game callbacks run on this thread
+static void RenderLoop( FrameRing* ring )
+{
+	timer t;
+	vector<SDL_Event> pending;
+	while (Pixel* frame = ring->AcquireFree())
+	{
+		surface->SetBuffer( frame );
+		if (firstframe)
+		{
+			game->Init();
+			firstframe = false;
+			t.reset();
+		}
+		{ lock_guard<mutex> lock( eventLock ); pending.swap( events ); }
+		for( uint i = 0; i < pending.size(); i++ ) HandleEvent( pending[i] );
+		pending.clear();
+		// calculate frame time and pass it to game->Tick
+		JobProfiler::FrameBegin();
+		game->Tick( t.elapsed() );
+		JobProfiler::FrameEnd();
+		t.reset();
+		ring->Submit( frame );
+	}
+}
+
 int main( int argc, char **argv ) 
 {  
 #ifdef _MSC_VER
@@ -264,7 +462,8 @@ int main( int argc, char **argv )
 #else
 	window = SDL_CreateWindow( TEMPLATE_VERSION, 100, 100, SCRWIDTH, SCRHEIGHT, SDL_WINDOW_SHOWN );
 #endif
-	surface = new Surface( SCRWIDTH, SCRHEIGHT );
+	FrameRing ring( FRAME_BUFFERS, SCRWIDTH * SCRHEIGHT );
+	surface = new Surface( SCRWIDTH, SCRHEIGHT, ring.GetBuffer( 0 ), SCRWIDTH );
 	surface->Clear( 0 );
 	SDL_Renderer* renderer = SDL_CreateRenderer( window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
 	SDL_Texture* frameBuffer = SDL_CreateTexture( renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCRWIDTH, SCRHEIGHT );
@@ -272,76 +471,75 @@ int main( int argc, char **argv )
 	int exitapp = 0;
 	game = new Game();
 	game->SetTarget( surface );
+#ifdef ADVANCEDGL
+	// the gl frame buffer is mapped memory: render and present serially
 	timer t;
 	t.reset();
 	while (!exitapp) 
 	{
-	#ifdef ADVANCEDGL
 		swap();
 		surface->SetBuffer( (Pixel*)framedata );
-	#else
-		void* target = 0;
-		int pitch;
-		SDL_LockTexture( frameBuffer, NULL, &target, &pitch );
-		if (pitch == (surface->GetWidth() * 4))
-		{
-			memcpy( target, surface->GetBuffer(), SCRWIDTH * SCRHEIGHT * 4 );
-		}
-		else
-		{
-			unsigned char* t = (unsigned char*)target;
-			for( int i = 0; i < SCRHEIGHT; i++ )
-			{
-				memcpy( t, surface->GetBuffer() + i * SCRWIDTH, SCRWIDTH * 4 );
-				t += pitch;
-			}
-		}
-		SDL_UnlockTexture( frameBuffer );
-		SDL_RenderCopy( renderer, frameBuffer, NULL, NULL );
-		SDL_RenderPresent( renderer );
-	#endif
 		if (firstframe)
 		{
 			game->Init();
 			firstframe = false;
 		}
 		// calculate frame time and pass it to game->Tick
+		JobProfiler::FrameBegin();
 		game->Tick( t.elapsed() );
+		JobProfiler::FrameEnd();
 		t.reset();
 		// event loop
 		SDL_Event event;
 		while (SDL_PollEvent( &event )) 
 		{
-			switch (event.type)
+			if (IsQuit( event )) exitapp = 1;
+			HandleEvent( event );
+		}
+	}
+#else
+	// pipelined: the render thread draws frame N+1 while this thread presents frame N
+	thread renderThread( RenderLoop, &ring );
+	while (!exitapp) 
+	{
+		Pixel* frame = ring.AcquireReady( 5 );
+		if (frame)
+		{
+			JobProfiler::Begin( "present" );
+			void* target = 0;
+			int pitch;
+			SDL_LockTexture( frameBuffer, NULL, &target, &pitch );
+			if (pitch == (surface->GetWidth() * 4))
 			{
-			case SDL_QUIT:
-				exitapp = 1;
-				break;
-			case SDL_KEYDOWN:
-				if (event.key.keysym.sym == SDLK_ESCAPE) 
+				memcpy( target, frame, SCRWIDTH * SCRHEIGHT * 4 );
+			}
+			else
+			{
+				unsigned char* t = (unsigned char*)target;
+				for( int i = 0; i < SCRHEIGHT; i++ )
 				{
-					exitapp = 1;
-					// find other keys here: http://sdl.beuc.net/sdl.wiki/SDLKey
+					memcpy( t, frame + i * SCRWIDTH, SCRWIDTH * 4 );
+					t += pitch;
 				}
-				game->KeyDown( event.key.keysym.scancode );
-				break;
-			case SDL_KEYUP:
-				game->KeyUp( event.key.keysym.scancode );
-				break;
-			case SDL_MOUSEMOTION:
-				game->MouseMove( event.motion.xrel, event.motion.yrel );
-				break;
-			case SDL_MOUSEBUTTONUP:
-				game->MouseUp( event.button.button );
-				break;
-			case SDL_MOUSEBUTTONDOWN:
-				game->MouseDown( event.button.button );
-				break;
-			default:
-				break;
 			}
+			SDL_UnlockTexture( frameBuffer );
+			ring.Release( frame );
+			SDL_RenderCopy( renderer, frameBuffer, NULL, NULL );
+			SDL_RenderPresent( renderer );
+			JobProfiler::End( "present" );
+		}
+		// event loop
+		SDL_Event event;
+		while (SDL_PollEvent( &event )) 
+		{
+			if (IsQuit( event )) exitapp = 1;
+			lock_guard<mutex> lock( eventLock );
+			events.push_back( event );
 		}
 	}
+	ring.Shutdown();
+	renderThread.join();
+#endif
 	game->Shutdown();
 	SDL_Quit();
 	return 1;
@@ -13,6 +13,7 @@ int filesize( FILE* f );
 
 typedef unsigned char uchar;
 typedef unsigned char byte;
+typedef unsigned short ushort;
 typedef __int64 int64;
 typedef unsigned __int64 uint64;
 typedef unsigned int uint;
@@ -63,6 +64,84 @@ struct timer
 	} 
 };
 
+// -----------------------------------------------------------
+// Arena class
+// bump allocator: allocations are carved from large 64-byte
+// aligned blocks, and released all at once by Reset or on
+// destruction. there is no per-allocation free.
+// -----------------------------------------------------------
+class Arena
+{
+public:
+	Arena( size_t size = 16 << 20 ) : head( 0 ), cur( 0 ), left( 0 ), blockSize( size ), used( 0 ) {}
+	~Arena() { Reset(); }
+	void* Alloc( size_t size, size_t align = 64 )
+	{
+		size_t pad = (align - ((size_t)cur & (align - 1))) & (align - 1);
+		if (pad + size > left) NewBlock( size ), pad = 0;
+		char* p = cur + pad;
+		cur += pad + size, left -= pad + size, used += size;
+		return p;
+	}
+	char* StrDup( const char* s ) { return strcpy( (char*)Alloc( strlen( s ) + 1, 1 ), s ); }
+	void Reset() { while (head) { char* next = *(char**)head; FREE64( head ); head = next; } cur = 0, left = used = 0; }
+	size_t Used() { return used; }
+	// scoped use: Rewind releases everything allocated since Mark
+	struct Marker { char* head, *cur; size_t left, used; };
+	Marker Mark() { Marker m = { head, cur, left, used }; return m; }
+	void Rewind( const Marker& m ) { while (head != m.head) { char* next = *(char**)head; FREE64( head ); head = next; } cur = m.cur, left = m.left, used = m.used; }
+	// allocates and writes the first block: its pages become local to the calling thread
+	void Prefault() { if (!head) NewBlock( 0 ); memset( cur, 0, left ); }
+private:
+	Arena( const Arena& );
+	void NewBlock( size_t size )
+	{
+		const size_t bytes = MAX( size, blockSize ) + 64; // first 64 bytes link to the previous block
+		char* block = (char*)MALLOC64( bytes );
+		*(char**)block = head, head = block;
+		cur = block + 64, left = bytes - 64;
+	}
+	char* head, *cur;
+	size_t left, blockSize, used;
+};
+
+// allocator for stl containers that live in an arena (or on the heap, if arena is 0)
+template <class T> struct ArenaAllocator
+{
+	typedef T value_type;
+	ArenaAllocator( Arena* a = 0 ) : arena( a ) {}
+	template <class U> ArenaAllocator( const ArenaAllocator<U>& a ) : arena( a.arena ) {}
+	T* allocate( size_t n ) { return (T*)(arena ? arena->Alloc( n * sizeof( T ), alignof( T ) ) : malloc( n * sizeof( T ) )); }
+	void deallocate( T* p, size_t ) { if (!arena) free( p ); }
+	template <class U> bool operator == ( const ArenaAllocator<U>& a ) const { return arena == a.arena; }
+	template <class U> bool operator != ( const ArenaAllocator<U>& a ) const { return arena != a.arena; }
+	Arena* arena;
+};
+
+// -----------------------------------------------------------
+// MappedFile class
+// read-only view of a whole file. pages are read by the os on
+// first access, and stay in the file cache between runs.
+// Prefetch starts reading a range ahead of its use; Discard
+// drops the pages of a range from memory (they are read again
+// on the next access).
+// -----------------------------------------------------------
+class MappedFile
+{
+public:
+	MappedFile() : data( 0 ), size( 0 ), handle( 0 ) {}
+	~MappedFile() { Close(); }
+	bool Open( const char* file );
+	void Close();
+	void Prefetch( size_t offset, size_t bytes ) const;
+	void Discard( size_t offset, size_t bytes ) const;
+	const unsigned char* data;
+	size_t size;
+private:
+	MappedFile( const MappedFile& );
+	void* handle;
+};
+
 // vectors
 class vec2 // adapted from https://github.com/dcow/RayTracer
 {
@@ -252,4 +331,8 @@ mat4 inverse( mat4 m );
 
 #define BADFLOAT(x) ((*(uint*)&x & 0x7f000000) == 0x7f000000)
 
-}; // namespace Tmpl8
\ No newline at end of file
+}; // namespace Tmpl8
+
+// placement in an arena: new (arena) T( ... )
+inline void* operator new( size_t size, Tmpl8::Arena& arena ) { return arena.Alloc( size ); }
+inline void operator delete( void*, Tmpl8::Arena& ) {}
\ No newline at end of file
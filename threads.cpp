@@ -60,96 +60,575 @@ void Thread::SetName( char* _Name )
 	if (::IsDebuggerPresent()) RaiseException( 0x406D1388, 0, sizeof( info ) / sizeof( ULONG_PTR ), (ULONG_PTR*)&info );
 }
 
-DWORD JobThreadProc( LPVOID lpParameter )
+// -----------------------------------------------------------
+// WorkDeque implementation
+// after Le et al., "Correct and efficient work-stealing for
+// weak memory models", PPoPP 2013
+// -----------------------------------------------------------
+WorkDeque::WorkDeque( int capacity ) : top( 0 ), bottom( 0 ), ring( new Ring( capacity ) ) {}
+
+WorkDeque::~WorkDeque()
 {
-	JobThread* JobThreadInstance = (JobThread*) lpParameter;
-	JobThreadInstance->BackgroundTask();
-	return 0;
+	delete ring.load();
+	for( uint i = 0; i < retired.size(); i++ ) delete retired[i];
 }
 
-void JobThread::CreateAndStartThread( unsigned int threadId )
+WorkDeque::Ring* WorkDeque::Grow( Ring* r, int64 t, int64 b )
 {
-	m_GoSignal = CreateEvent( 0, FALSE, FALSE, 0 );
-	m_ThreadHandle = CreateThread( 0, 0, (LPTHREAD_START_ROUTINE) &JobThreadProc, (LPVOID) this, 0, 0 );
-	m_ThreadID = threadId;
+	Ring* bigger = new Ring( (r->mask + 1) * 2 );
+	for( int64 i = t; i < b; i++ ) bigger->Put( i, r->Get( i ) );
+	retired.push_back( r );
+	ring.store( bigger, std::memory_order_release );
+	return bigger;
 }
-void JobThread::BackgroundTask()
+
+void WorkDeque::Push( Job* a_Job )
 {
-	while (1)
+	const int64 b = bottom.load( std::memory_order_relaxed ), t = top.load( std::memory_order_acquire );
+	Ring* r = ring.load( std::memory_order_relaxed );
+	if (b - t > r->mask) r = Grow( r, t, b );
+	r->Put( b, a_Job );
+	bottom.store( b + 1, std::memory_order_release );
+}
+
+Job* WorkDeque::Pop()
+{
+	const int64 b = bottom.load( std::memory_order_relaxed ) - 1;
+	Ring* r = ring.load( std::memory_order_relaxed );
+	bottom.store( b, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+	int64 t = top.load( std::memory_order_relaxed );
+	Job* job = 0;
+	if (t <= b)
 	{
-		WaitForSingleObject( m_GoSignal, INFINITE );
-		while (1)
+		job = r->Get( b );
+		if (t == b)
 		{
-			Job* job = JobManager::GetJobManager()->GetNextJob();
-			if (!job) 
-			{
-				JobManager::GetJobManager()->ThreadDone( m_ThreadID );
-				break;
-			}
-			job->RunCodeWrapper();
+			// last job: race against thieves
+			if (!top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed )) job = 0;
+			bottom.store( b + 1, std::memory_order_relaxed );
 		}
 	}
+	else bottom.store( b + 1, std::memory_order_relaxed );
+	return job;
 }
 
-void JobThread::Go()
+Job* WorkDeque::Steal()
 {
-	SetEvent( m_GoSignal );
+	int64 t = top.load( std::memory_order_acquire );
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+	const int64 b = bottom.load( std::memory_order_acquire );
+	if (t >= b) return 0;
+	Job* job = ring.load( std::memory_order_acquire )->Get( t );
+	if (!top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed )) return 0;
+	return job;
 }
 
+// -----------------------------------------------------------
+// JobQueue implementation
+// D. Vyukov, "Bounded MPMC queue", 1024cores.net
+// -----------------------------------------------------------
+JobQueue::JobQueue( int capacity ) : cell( new Cell[capacity] ), mask( capacity - 1 ), tail( 0 ), head( 0 )
+{
+	for( int i = 0; i < capacity; i++ ) cell[i].seq.store( i, std::memory_order_relaxed ), cell[i].job = 0;
+}
+
+bool JobQueue::Push( Job* a_Job )
+{
+	int64 pos = tail.load( std::memory_order_relaxed );
+	Cell* c;
+	while (1)
+	{
+		c = &cell[pos & mask];
+		const int64 dif = c->seq.load( std::memory_order_acquire ) - pos;
+		if (dif == 0) { if (tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed )) break; }
+		else if (dif < 0) return false; // full
+		else pos = tail.load( std::memory_order_relaxed );
+	}
+	c->job = a_Job;
+	c->seq.store( pos + 1, std::memory_order_release );
+	return true;
+}
+
+Job* JobQueue::Pop()
+{
+	int64 pos = head.load( std::memory_order_relaxed );
+	Cell* c;
+	while (1)
+	{
+		c = &cell[pos & mask];
+		const int64 dif = c->seq.load( std::memory_order_acquire ) - (pos + 1);
+		if (dif == 0) { if (head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed )) break; }
+		else if (dif < 0) return 0; // empty
+		else pos = head.load( std::memory_order_relaxed );
+	}
+	Job* job = c->job;
+	c->seq.store( pos + mask + 1, std::memory_order_release );
+	return job;
+}
+
+// -----------------------------------------------------------
+// futex wrappers
+// waking only needs the address, so it is safe to wake after
+// the memory that held the atomic has been released.
+// -----------------------------------------------------------
+#ifdef _WIN32
+void Tmpl8::FutexWait( std::atomic<int>* a_Address, int a_Expected ) { WaitOnAddress( a_Address, &a_Expected, sizeof( int ), INFINITE ); }
+void Tmpl8::FutexWake( std::atomic<int>* a_Address, bool a_All ) { if (a_All) WakeByAddressAll( a_Address ); else WakeByAddressSingle( a_Address ); }
+#else
+void Tmpl8::FutexWait( std::atomic<int>* a_Address, int a_Expected ) { syscall( SYS_futex, (int*)a_Address, FUTEX_WAIT_PRIVATE, a_Expected, NULL, NULL, 0 ); }
+void Tmpl8::FutexWake( std::atomic<int>* a_Address, bool a_All ) { syscall( SYS_futex, (int*)a_Address, FUTEX_WAKE_PRIVATE, a_All ? INT_MAX : 1, NULL, NULL, 0 ); }
+#endif
+
 void Job::RunCodeWrapper()
 {
 	Main();
 }
+
+// -----------------------------------------------------------
+// CpuTopology implementation
+// -----------------------------------------------------------
+#ifndef _WIN32
+static int ReadInt( const char* a_Path, int a_Default )
+{
+	int value = a_Default;
+	FILE* f = fopen( a_Path, "r" );
+	if (!f) return a_Default;
+	if (fscanf( f, "%i", &value ) != 1) value = a_Default;
+	fclose( f );
+	return value;
+}
+
+static int NodeOf( int a_Cpu )
+{
+	char path[64];
+	sprintf( path, "/sys/devices/system/cpu/cpu%i", a_Cpu );
+	DIR* dir = opendir( path );
+	if (!dir) return 0;
+	int node = 0;
+	while (dirent* entry = readdir( dir )) if (sscanf( entry->d_name, "node%i", &node ) == 1) break;
+	closedir( dir );
+	return node;
+}
+#endif
+
+static int CountDistinct( const std::vector<CpuTopology::Cpu>& a_Cpu, int64 (*a_Key)( const CpuTopology::Cpu& ) )
+{
+	std::unordered_set<int64> keys;
+	for( uint i = 0; i < a_Cpu.size(); i++ ) keys.insert( a_Key( a_Cpu[i] ) );
+	return (int)keys.size();
+}
+
+void CpuTopology::Detect()
+{
+	cpu.clear();
+#ifdef _WIN32
+	DWORD_PTR process = 0, system = 0;
+	GetProcessAffinityMask( GetCurrentProcess(), &process, &system );
+	for( int i = 0; i < (int)sizeof( DWORD_PTR ) * 8; i++ ) if (process & ((DWORD_PTR)1 << i))
+	{
+		Cpu c = { i, i, 0, 0, 0, 0 };
+		cpu.push_back( c );
+	}
+#else
+	cpu_set_t allowed;
+	CPU_ZERO( &allowed );
+	sched_getaffinity( 0, sizeof( allowed ), &allowed );
+	for( int i = 0; i < CPU_SETSIZE; i++ ) if (CPU_ISSET( i, &allowed ))
+	{
+		char path[96];
+		Cpu c = { i, i, 0, 0, 0, 0 };
+		sprintf( path, "/sys/devices/system/cpu/cpu%i/topology/core_id", i ), c.core = ReadInt( path, i );
+		sprintf( path, "/sys/devices/system/cpu/cpu%i/topology/physical_package_id", i ), c.package = ReadInt( path, 0 );
+		sprintf( path, "/sys/devices/system/cpu/cpu%i/cache/index3/id", i ), c.l3 = ReadInt( path, c.package );
+		c.node = NodeOf( i );
+		cpu.push_back( c );
+	}
+#endif
+	if (cpu.empty()) for( int i = 0; i < (int)MAX( 1u, std::thread::hardware_concurrency() ); i++ )
+	{
+		Cpu c = { i, i, 0, 0, 0, 0 };
+		cpu.push_back( c );
+	}
+	// rank SMT siblings: the first logical processor of a core has rank 0
+	for( uint i = 0; i < cpu.size(); i++ ) for( uint j = 0; j < i; j++ )
+		if ((cpu[j].package == cpu[i].package) && (cpu[j].core == cpu[i].core)) cpu[i].smt++;
+	std::sort( cpu.begin(), cpu.end(), []( const Cpu& a, const Cpu& b )
+	{
+		if (a.node != b.node) return a.node < b.node;
+		if (a.package != b.package) return a.package < b.package;
+		if (a.l3 != b.l3) return a.l3 < b.l3;
+		if (a.smt != b.smt) return a.smt < b.smt;
+		return a.id < b.id;
+	} );
+	cores = CountDistinct( cpu, []( const Cpu& c ) { return ((int64)c.package << 32) + c.core; } );
+	packages = CountDistinct( cpu, []( const Cpu& c ) { return (int64)c.package; } );
+	l3s = CountDistinct( cpu, []( const Cpu& c ) { return ((int64)c.package << 32) + c.l3; } );
+	nodes = CountDistinct( cpu, []( const Cpu& c ) { return (int64)c.node; } );
+}
+
+// -----------------------------------------------------------
+// JobManager implementation
+// -----------------------------------------------------------
 JobManager* JobManager::m_JobManager = 0;
+thread_local int JobManager::s_Worker = -1;
+CpuTopology JobManager::s_Topology;
 
-JobManager::JobManager( unsigned int threads ) : m_NumThreads( threads )
+JobManager::JobManager( unsigned int threads ) : m_Queued( 0 ), m_Sleeping( 0 ), m_Wake( 0 ), m_Quit( false ), m_NumThreads( threads )
 {
-	InitializeCriticalSection( &m_CS );
+	m_JobThreadList = new JobThread[threads];
 }
 
 JobManager::~JobManager()
 {
-	DeleteCriticalSection( &m_CS );
+	m_Quit = true;
+	m_Wake.fetch_add( 1, std::memory_order_seq_cst );
+	FutexWake( &m_Wake, true );
+	for( unsigned int i = 1; i < m_NumThreads; i++ ) m_JobThreadList[i].thread.join();
+	delete[] m_JobThreadList;
+	if (m_JobManager == this) m_JobManager = 0, s_Worker = -1;
+}
+
+// topology of the machine, detected once: later job managers may be created
+// from a pinned thread, which no longer sees all processors
+const CpuTopology& JobManager::GetTopology()
+{
+	if (s_Topology.cpu.empty()) s_Topology.Detect();
+	return s_Topology;
 }
 
+// the calling thread becomes worker 0, and takes part in RunJobs / Wait
 void JobManager::CreateJobManager( unsigned int numThreads )
 {
+	if (!numThreads) numThreads = MAX( 1u, std::thread::hardware_concurrency() );
+	const CpuTopology& topology = GetTopology();
 	m_JobManager = new JobManager( numThreads );
-	m_JobManager->m_JobThreadList = new JobThread[numThreads];
-	for ( unsigned int i = 0 ; i < numThreads; i++ ) 
+#ifdef PIN_WORKERS
+	for( unsigned int i = 0; i < numThreads; i++ ) m_JobManager->m_JobThreadList[i].cpu = topology.cpu[i % topology.cpu.size()].id;
+#else
+	(void)topology;
+#endif
+	m_JobManager->StartWorker( 0 );
+	for( unsigned int i = 1; i < numThreads; i++ )
+		m_JobManager->m_JobThreadList[i].thread = std::thread( &JobManager::WorkerMain, m_JobManager, i );
+}
+
+// runs on the worker thread: pins it, then touches its scratch memory, so that
+// the pages are allocated on the NUMA node of the worker
+void JobManager::StartWorker( int a_Worker )
+{
+	s_Worker = a_Worker;
+	JobThread& worker = m_JobThreadList[a_Worker];
+	if (worker.cpu >= 0)
+	{
+	#ifdef _WIN32
+		SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)1 << worker.cpu );
+	#else
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		CPU_SET( worker.cpu, &set );
+		pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+	#endif
+	}
+	worker.scratch.Prefault();
+}
+
+// a job goes to the deque of the calling worker, or to the injection queue
+void JobManager::Enqueue( Job* a_Job )
+{
+	if (s_Worker >= 0) m_JobThreadList[s_Worker].deque.Push( a_Job );
+	else while (!m_Injected.Push( a_Job ))
 	{
-		m_JobManager->m_JobThreadList[i].CreateAndStartThread( i );
-		m_JobManager->m_ThreadDone[i] = CreateEvent( 0, FALSE, FALSE, 0 );
+		// injection queue full: help draining it
+		Job* job = FindJob( -1 );
+		if (job) Execute( job ); else std::this_thread::yield();
 	}
-	m_JobManager->m_JobCount = 0;
 }
 
-void JobManager::AddJob2( Job* a_Job )
+// a worker that is about to sleep either sees the new job, or is woken here
+void JobManager::Wake( bool a_All )
+{
+	if (m_Sleeping.load( std::memory_order_seq_cst ) > 0)
+	{
+		m_Wake.fetch_add( 1, std::memory_order_seq_cst );
+		FutexWake( &m_Wake, a_All );
+	}
+}
+
+void JobManager::AddJob2( Job* a_Job, JobCounter* a_Counter )
+{
+	a_Job->m_Counter = a_Counter ? a_Counter : &m_Batch;
+	a_Job->m_Counter->count.fetch_add( 1, std::memory_order_relaxed );
+	m_Queued.fetch_add( 1, std::memory_order_seq_cst );
+	Enqueue( a_Job );
+	Wake( false );
+}
+
+// assigned jobs wake all sleepers: waking one could miss the assigned worker
+void JobManager::AddJobTo( Job* a_Job, int a_Worker, JobCounter* a_Counter )
 {
-	m_JobList[m_JobCount++] = a_Job;
+	a_Job->m_Counter = a_Counter ? a_Counter : &m_Batch;
+	a_Job->m_Counter->count.fetch_add( 1, std::memory_order_relaxed );
+	m_Queued.fetch_add( 1, std::memory_order_seq_cst );
+	if (!m_JobThreadList[a_Worker % m_NumThreads].mailbox.Push( a_Job )) Enqueue( a_Job );
+	Wake( true );
 }
 
-Job* JobManager::GetNextJob()
+// own mailbox first (assigned jobs), then the own deque (most recently added,
+// warm in cache), then the injection queue, then a random victim; mailboxes
+// of other workers are the last resort, for threads that have been idle a while
+Job* JobManager::FindJob( int a_Worker, bool a_Mailboxes )
 {
 	Job* job = 0;
-	EnterCriticalSection( &m_CS );
-	if (m_JobCount > 0) job = m_JobList[--m_JobCount];
-	LeaveCriticalSection( &m_CS );
+	if (a_Worker >= 0) if (!(job = m_JobThreadList[a_Worker].mailbox.Pop())) job = m_JobThreadList[a_Worker].deque.Pop();
+	if (!job) job = m_Injected.Pop();
+	if (!job && (m_NumThreads > 1))
+	{
+		static thread_local uint rng = 0x9e3779b9u * (uint)(a_Worker + 2);
+		rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5;
+		for( unsigned int i = 0; (i < m_NumThreads) && !job; i++ )
+		{
+			const unsigned int victim = (rng + i) % m_NumThreads;
+			if (victim != (unsigned int)a_Worker) if ((job = m_JobThreadList[victim].deque.Steal())) JobProfiler::Instant( "steal", victim );
+		}
+		for( unsigned int i = 0; (i < m_NumThreads) && !job && a_Mailboxes; i++ )
+		{
+			const unsigned int victim = (rng + i) % m_NumThreads;
+			if (victim != (unsigned int)a_Worker) if ((job = m_JobThreadList[victim].mailbox.Pop())) JobProfiler::Instant( "steal", victim );
+		}
+	}
+	if (job) m_Queued.fetch_sub( 1, std::memory_order_relaxed );
 	return job;
 }
 
+void JobManager::Execute( Job* a_Job )
+{
+	JobCounter* counter = a_Job->m_Counter;
+	const char* name = a_Job->GetName();
+	JobProfiler::Begin( name );
+	a_Job->RunCodeWrapper();
+	JobProfiler::End( name );
+	// the counter may be gone once the count drops: only its address is used
+	if (counter->count.fetch_sub( 1, std::memory_order_acq_rel ) == (JobCounter::WAITING | 1)) FutexWake( &counter->count, true );
+}
+
+void JobManager::WorkerMain( int a_Worker )
+{
+	StartWorker( a_Worker );
+	while (!m_Quit)
+	{
+		Job* job = FindJob( a_Worker, false );
+		if (job) { Execute( job ); continue; }
+		JobProfiler::Begin( "idle" );
+		for( int spin = 0; (spin < 64) && !job; spin++ ) if (!(job = FindJob( a_Worker, spin >= 16 ))) std::this_thread::yield();
+		if (!job)
+		{
+			// announce, then sample the futex word, then check for work: a job
+			// added after the check bumps the word, so the wait returns at once
+			m_Sleeping.fetch_add( 1, std::memory_order_seq_cst );
+			const int wake = m_Wake.load( std::memory_order_seq_cst );
+			if (!m_Quit && (m_Queued.load( std::memory_order_seq_cst ) <= 0)) FutexWait( &m_Wake, wake );
+			m_Sleeping.fetch_sub( 1, std::memory_order_relaxed );
+		}
+		JobProfiler::End( "idle" );
+		if (job) Execute( job );
+	}
+}
+
+// executes jobs until the counter drops to zero; jobs of other counters may
+// run in the meantime. when there is nothing left to help with, the thread
+// sleeps until the last job of the counter completes. safe to call from
+// within a job.
+void JobManager::Wait( JobCounter* a_Counter )
+{
+	int idle = 0;
+	while (!a_Counter->Done())
+	{
+		Job* job = FindJob( s_Worker, idle >= 16 );
+		if (job) { Execute( job ), idle = 0; continue; }
+		if (++idle < 64) { std::this_thread::yield(); continue; }
+		const int count = a_Counter->count.fetch_or( JobCounter::WAITING, std::memory_order_acq_rel ) | JobCounter::WAITING;
+		if (count == JobCounter::WAITING) continue;
+		JobProfiler::Begin( "wait" );
+		FutexWait( &a_Counter->count, count );
+		JobProfiler::End( "wait" );
+	}
+	a_Counter->count.fetch_and( ~JobCounter::WAITING, std::memory_order_relaxed );
+}
+
+// runs all jobs that were added without a counter, and returns when they are done
 void JobManager::RunJobs()
 {
-	for ( unsigned int i = 0; i < m_NumThreads; i++ ) 
+	Wait( &m_Batch );
+}
+
+// -----------------------------------------------------------
+// JobProfiler implementation
+// -----------------------------------------------------------
+std::atomic<bool> JobProfiler::s_Active( false );
+std::atomic<int> JobProfiler::s_Frames( 0 ), JobProfiler::s_Dropped( 0 );
+std::mutex JobProfiler::s_Lock;
+std::vector<JobProfiler::Buffer*> JobProfiler::s_Buffers;
+int JobProfiler::s_Threads = 0;
+int64 JobProfiler::s_Start = 0;
+char JobProfiler::s_File[256];
+
+// arms the profiler; recording starts at the next frame
+void JobProfiler::Capture( int frames, const char* file )
+{
+	if (s_Active || (frames < 1)) return;
+	strncpy( s_File, file, sizeof( s_File ) - 1 );
+	s_Frames = frames;
+}
+
+void JobProfiler::FrameBegin()
+{
+	if (!s_Active && (s_Frames > 0))
+	{
+		std::lock_guard<std::mutex> lock( s_Lock );
+		for( uint i = 0; i < s_Buffers.size(); i++ ) s_Buffers[i]->count.store( 0, std::memory_order_relaxed );
+		s_Dropped = 0, s_Start = timer::get();
+		s_Active = true;
+	}
+	Begin( "frame" );
+}
+
+void JobProfiler::FrameEnd()
+{
+	if (!s_Active) return;
+	End( "frame" );
+	if (--s_Frames > 0) return;
+	s_Active = false;
+	Export();
+}
+
+// the buffer of the calling thread is created on its first event
+JobProfiler::Buffer* JobProfiler::Register()
+{
+	Buffer* buffer = new Buffer();
+	buffer->event = new Event[EVENTS];
+	buffer->count.store( 0, std::memory_order_relaxed );
+	buffer->worker = JobManager::GetWorkerIndex() >= 0;
+	std::lock_guard<std::mutex> lock( s_Lock );
+	buffer->id = buffer->worker ? JobManager::GetWorkerIndex() : s_Threads++;
+	s_Buffers.push_back( buffer );
+	return buffer;
+}
+
+// the buffer of an exiting thread is removed, with the events it recorded in
+// an unfinished capture: a worker of a later job manager, with the same index,
+// gets a track of its own
+void JobProfiler::Release( Buffer* buffer )
+{
+	std::lock_guard<std::mutex> lock( s_Lock );
+	s_Buffers.erase( std::find( s_Buffers.begin(), s_Buffers.end(), buffer ) );
+	delete[] buffer->event;
+	delete buffer;
+}
+
+JobProfiler::Owner::~Owner() { if (buffer) Release( buffer ); }
+
+// only the owning thread writes a buffer; the count is published with
+// release semantics, so that the exporter sees complete events
+void JobProfiler::Record( int type, const char* name, int arg )
+{
+	static thread_local Owner owner;
+	Buffer* buffer = owner.buffer;
+	if (!buffer) buffer = owner.buffer = Register();
+	const int n = buffer->count.load( std::memory_order_relaxed );
+	if (n >= EVENTS) { s_Dropped++; return; }
+	Event& e = buffer->event[n];
+	e.time = timer::get(), e.name = name, e.type = type, e.arg = arg;
+	buffer->count.store( n + 1, std::memory_order_release );
+}
+
+// writes the trace, and prints busy time, idle time and steals per thread
+void JobProfiler::Export()
+{
+	timer::init();
+	FILE* f = fopen( s_File, "w" );
+	if (!f) { printf( "profiler: could not write %s\n", s_File ); return; }
+	std::lock_guard<std::mutex> lock( s_Lock );
+	fprintf( f, "{\"traceEvents\":[\n" );
+	const char* phase[3] = { "B", "E", "i" };
+	int events = 0;
+	for( uint i = 0; i < s_Buffers.size(); i++ )
 	{
-		m_JobThreadList[i].Go();
+		Buffer* b = s_Buffers[i];
+		const int count = b->count.load( std::memory_order_acquire );
+		if (!count) continue;
+		const int tid = i + 1;
+		fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s %i\"}}", events ? ",\n" : "", tid, b->worker ? "worker" : "thread", b->id );
+		double busy = 0, idle = 0, start = 0, sleep = 0;
+		int depth = 0, steals = 0;
+		for( int j = 0; j < count; j++, events++ )
+		{
+			const Event& e = b->event[j];
+			const double t = timer::to_time( e.time - s_Start ) * 1000; // microseconds
+			fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%i", e.name, phase[e.type], t, tid );
+			if (e.type == INSTANT) fprintf( f, ",\"s\":\"t\",\"args\":{\"victim\":%i}}", e.arg ), steals++; else fprintf( f, "}" );
+			// busy: outermost spans other than frame, idle and wait
+			const bool waiting = !strcmp( e.name, "idle" ) || !strcmp( e.name, "wait" ), work = !waiting && strcmp( e.name, "frame" );
+			if (e.type == BEGIN && work && !depth++) start = t;
+			if (e.type == END && work && depth > 0 && !--depth) busy += t - start;
+			if (e.type == BEGIN && waiting) sleep = t;
+			if (e.type == END && waiting) idle += t - sleep, busy -= depth ? t - sleep : 0;
+		}
+		printf( "profiler: %s %i: busy %.2fms, idle %.2fms, %i steals\n", b->worker ? "worker" : "thread", b->id, busy / 1000, idle / 1000, steals );
 	}
-	WaitForMultipleObjects( m_NumThreads, m_ThreadDone, TRUE, INFINITE );
+	fprintf( f, "\n]}\n" );
+	fclose( f );
+	printf( "profiler: wrote %i events to %s (%i dropped)\n", events, s_File, s_Dropped.load() );
 }
 
-void JobManager::ThreadDone( unsigned int n ) 
-{ 
-	SetEvent( m_ThreadDone[n] ); 
+// -----------------------------------------------------------
+// TaskGraph implementation
+// -----------------------------------------------------------
+// worker >= 0 assigns the task to a worker, so that it runs on the same core
+// every frame; see JobManager::AddJobTo
+int TaskGraph::Add( const char* name, const std::function<void()>& work, int worker )
+{
+	Task* task = new Task();
+	task->graph = this, task->name = name, task->worker = worker, task->work = work, task->predecessors = 0;
+	tasks.push_back( task );
+	return (int)tasks.size() - 1;
+}
+
+void TaskGraph::Depend( int task, int predecessor )
+{
+	tasks[predecessor]->successors.push_back( tasks[task] );
+	tasks[task]->predecessors++;
+}
+
+void TaskGraph::Clear()
+{
+	for( uint i = 0; i < tasks.size(); i++ ) delete tasks[i];
+	tasks.clear();
+}
+
+// without a job manager, ready tasks run on the calling thread, in dependency order
+void TaskGraph::Ready( Task* task )
+{
+	JobManager* jm = JobManager::GetJobManager();
+	if (!jm) task->Main();
+	else if (task->worker >= 0) jm->AddJobTo( task, task->worker, &counter );
+	else jm->AddJob2( task, &counter );
+}
+
+void TaskGraph::Task::Main()
+{
+	work();
+	for( uint i = 0; i < successors.size(); i++ )
+		if (successors[i]->pending.fetch_sub( 1, std::memory_order_acq_rel ) == 1) graph->Ready( successors[i] );
+}
+
+// executes all tasks, and returns when they are done
+void TaskGraph::Run()
+{
+	for( uint i = 0; i < tasks.size(); i++ ) tasks[i]->pending.store( tasks[i]->predecessors, std::memory_order_relaxed );
+	for( uint i = 0; i < tasks.size(); i++ ) if (!tasks[i]->predecessors) Ready( tasks[i] );
+	JobManager* jm = JobManager::GetJobManager();
+	if (jm) jm->Wait( &counter );
 }
 
 // EOF
\ No newline at end of file
@@ -31,49 +31,317 @@ extern "C" { unsigned int sthread_proc( void* param ); }
 
 namespace Tmpl8 {
 
+// jobs added with a counter increment it, and decrement it once they are done;
+// JobManager::Wait helps executing jobs until the counter reaches zero, and
+// sleeps on the counter when there is nothing to help with. the WAITING bit
+// tells the job that brings the count to zero to wake the (single) waiter.
+class JobCounter
+{
+public:
+	enum { WAITING = 1 << 30 };
+	JobCounter() : count( 0 ) {}
+	bool Done() { return (count.load( std::memory_order_acquire ) & ~WAITING) == 0; }
+	std::atomic<int> count;
+};
+
+// futex: sleep while an atomic holds an expected value, and wake sleepers
+// after changing it (WaitOnAddress on Windows, the futex syscall on Linux)
+void FutexWait( std::atomic<int>* a_Address, int a_Expected );
+void FutexWake( std::atomic<int>* a_Address, bool a_All );
+
 class Job
 {
 public:
+	Job() : m_Counter( 0 ) {}
+	virtual ~Job() {}
 	virtual void Main() = 0;
+	virtual const char* GetName() { return "job"; }	// label in profiler traces
 protected:
-	friend class JobThread;
+	friend class JobManager;
 	void RunCodeWrapper();
+	JobCounter* m_Counter;
+};
+
+// Chase-Lev work-stealing deque: the owning thread pushes and pops at the
+// bottom, other threads steal from the top. the ring grows when full; old
+// rings are kept until destruction, as a thief may still be reading them.
+class WorkDeque
+{
+public:
+	WorkDeque( int capacity = 256 );
+	~WorkDeque();
+	void Push( Job* a_Job );
+	Job* Pop();
+	Job* Steal();
+	bool Empty() { return bottom.load( std::memory_order_relaxed ) <= top.load( std::memory_order_relaxed ); }
+private:
+	struct Ring
+	{
+		Ring( int64 size ) : mask( size - 1 ), slot( new std::atomic<Job*>[(size_t)size] ) {}
+		~Ring() { delete[] slot; }
+		Job* Get( int64 i ) { return slot[i & mask].load( std::memory_order_relaxed ); }
+		void Put( int64 i, Job* job ) { slot[i & mask].store( job, std::memory_order_relaxed ); }
+		int64 mask;
+		std::atomic<Job*>* slot;
+	};
+	Ring* Grow( Ring* r, int64 t, int64 b );
+	std::atomic<int64> top, bottom;
+	std::atomic<Ring*> ring;
+	std::vector<Ring*> retired;
+};
+
+// bounded lock-free multi-producer multi-consumer queue, after Vyukov: each
+// cell holds a sequence number that tells producers and consumers whose turn
+// it is, so that a push or pop is a single CAS. Push fails when full.
+class JobQueue
+{
+public:
+	JobQueue( int capacity = 4096 );
+	~JobQueue() { delete[] cell; }
+	bool Push( Job* a_Job );
+	Job* Pop();
+private:
+	JobQueue( const JobQueue& );
+	struct Cell { std::atomic<int64> seq; Job* job; };
+	Cell* cell;
+	int64 mask;
+	char pad0[64];
+	std::atomic<int64> tail;		// next push position
+	char pad1[64];
+	std::atomic<int64> head;		// next pop position
+	char pad2[64];
+};
+
+// logical processors available to the process, with their physical core,
+// package, L3 domain and NUMA node. on Linux this is read from sysfs; on other
+// platforms each logical processor counts as a core of a single package.
+class CpuTopology
+{
+public:
+	struct Cpu { int id, core, package, l3, node, smt; };
+	CpuTopology() : cores( 0 ), packages( 0 ), l3s( 0 ), nodes( 0 ) {}
+	void Detect();
+	std::vector<Cpu> cpu;			// NUMA node, package and L3 domain major; physical cores before SMT siblings
+	int cores, packages, l3s, nodes;
 };
 
+// worker state: each worker owns a deque, a mailbox for jobs that were
+// assigned to it, and scratch memory. the thread that created the job
+// manager is worker 0 and has no std::thread of its own.
 class JobThread
 {
 public:
-	void CreateAndStartThread( unsigned int threadId );
-	void WaitForThreadToStop();
-	void Go();
-	void BackgroundTask();
-	HANDLE m_GoSignal, m_ThreadHandle;
-	int m_ThreadID;
+	JobThread() : mailbox( 256 ), scratch( 1 << 20 ), cpu( -1 ) {}
+	WorkDeque deque;
+	JobQueue mailbox;
+	Arena scratch;					// first touched by the worker, see GetScratch
+	std::thread thread;
+	int cpu;						// logical processor the worker is pinned to, or -1
 };
 
+// work-stealing scheduler. jobs added by a worker go to its own deque; jobs
+// added by other threads go to a shared lock-free injection queue. idle
+// workers steal from random victims, and sleep on a futex when there is no
+// work at all; adding a job only makes a syscall if a worker is asleep.
+// AddJobTo assigns a job to a worker: the worker takes it before anything
+// else, others only when they run out of work (soft affinity). with
+// PIN_WORKERS, workers are pinned in CpuTopology order.
 class JobManager	// singleton class!
 {
 protected:
 	JobManager( unsigned int numThreads );
 public:
 	~JobManager();
-	static void CreateJobManager( unsigned int numThreads );
+	static void CreateJobManager( unsigned int numThreads = 0 );	// 0: one per hardware thread
 	static JobManager* GetJobManager() { return m_JobManager; }
-	void AddJob2( Job* a_Job );
+	void AddJob2( Job* a_Job, JobCounter* a_Counter = 0 );
+	void AddJobTo( Job* a_Job, int a_Worker, JobCounter* a_Counter = 0 );
 	unsigned int GetNumThreads() { return m_NumThreads; }
 	void RunJobs();
-	void ThreadDone( unsigned int n );
+	void Wait( JobCounter* a_Counter );
 	int MaxConcurrent() { return m_NumThreads; }
+	static int GetWorkerIndex() { return s_Worker; }	// -1 on threads that are not workers
+	static Arena* GetScratch() { return (s_Worker >= 0 && m_JobManager) ? &m_JobManager->m_JobThreadList[s_Worker].scratch : 0; }
+	static const CpuTopology& GetTopology();
 protected:
-	friend class JobThread;
-	Job* GetNextJob();
-	Job* FindNextJob();
+	void Enqueue( Job* a_Job );
+	void Wake( bool a_All );
+	void StartWorker( int a_Worker );
+	Job* FindJob( int a_Worker, bool a_Mailboxes = true );
+	void Execute( Job* a_Job );
+	void WorkerMain( int a_Worker );
 	static JobManager* m_JobManager;
-	Job* m_JobList[64];
-	CRITICAL_SECTION m_CS;
-	HANDLE m_ThreadDone[4];
-	unsigned int m_NumThreads, m_JobCount;
+	static thread_local int s_Worker;
+	static CpuTopology s_Topology;
 	JobThread* m_JobThreadList;
+	JobCounter m_Batch;				// jobs added without a counter, see RunJobs
+	JobQueue m_Injected;			// jobs added by threads that are not workers
+	std::atomic<int> m_Queued, m_Sleeping;
+	std::atomic<int> m_Wake;		// futex word; bumped to wake sleeping workers
+	std::atomic<bool> m_Quit;
+	unsigned int m_NumThreads;
 };
 
+// -----------------------------------------------------------
+// JobProfiler class
+// records job execution, steals, idle time and frame phases
+// into per-thread event buffers, for a number of frames, and
+// writes them as Chrome trace JSON (chrome://tracing, or
+// ui.perfetto.dev). recording is armed by Capture and starts
+// at the next FrameBegin; when not capturing, each probe is a
+// single relaxed load. names must be string literals.
+// a buffer lives as long as its thread: the workers of a job
+// manager that is recreated get new tracks.
+// -----------------------------------------------------------
+class JobProfiler
+{
+public:
+	enum { BEGIN = 0, END, INSTANT };
+	enum { EVENTS = 1 << 16 };		// per thread; later events are dropped
+	static void Capture( int frames, const char* file );
+	static void FrameBegin();
+	static void FrameEnd();
+	static void Begin( const char* name ) { if (s_Active.load( std::memory_order_relaxed )) Record( BEGIN, name, 0 ); }
+	static void End( const char* name ) { if (s_Active.load( std::memory_order_relaxed )) Record( END, name, 0 ); }
+	static void Instant( const char* name, int arg ) { if (s_Active.load( std::memory_order_relaxed )) Record( INSTANT, name, arg ); }
+	static bool IsCapturing() { return s_Active.load( std::memory_order_relaxed ); }
+private:
+	struct Event { int64 time; const char* name; int type, arg; };
+	struct Buffer { Event* event; std::atomic<int> count; int id; bool worker; };
+	struct Owner { Buffer* buffer = 0; ~Owner(); };	// per thread; releases the buffer when the thread exits
+	static void Record( int type, const char* name, int arg );
+	static Buffer* Register();
+	static void Release( Buffer* buffer );
+	static void Export();
+	static std::atomic<bool> s_Active;
+	static std::atomic<int> s_Frames, s_Dropped;
+	static std::mutex s_Lock;			// guards the buffer list
+	static std::vector<Buffer*> s_Buffers;
+	static int s_Threads;				// threads other than workers registered so far, for their track names
+	static int64 s_Start;
+	static char s_File[256];
+};
+
+// -----------------------------------------------------------
+// TaskGraph class
+// tasks with explicit dependencies, declared once and executed
+// every frame. a task becomes ready when all of its
+// predecessors are done; ready tasks run as jobs, so that
+// independent tasks overlap. Run resets the dependency counts
+// in place: executing a graph does not allocate.
+// -----------------------------------------------------------
+class TaskGraph
+{
+public:
+	TaskGraph() {}
+	~TaskGraph() { Clear(); }
+	int Add( const char* name, const std::function<void()>& work, int worker = -1 );
+	void Depend( int task, int predecessor );
+	void Run();
+	void Clear();
+	int GetTaskCount() { return (int)tasks.size(); }
+	const char* GetName( int task ) { return tasks[task]->name; }
+private:
+	TaskGraph( const TaskGraph& );
+	struct Task : public Job
+	{
+		void Main();
+		const char* GetName() { return name; }
+		TaskGraph* graph;
+		const char* name;
+		int worker;					// preferred worker (modulo the thread count), or -1
+		std::function<void()> work;
+		std::vector<Task*> successors;
+		int predecessors;
+		std::atomic<int> pending;
+	};
+	void Ready( Task* task );
+	std::vector<Task*> tasks;
+	JobCounter counter;
+};
+
+// -----------------------------------------------------------
+// parallel_for / parallel_reduce
+// the range [begin, end) is cut into chunks of grain elements
+// (grain <= 0: about 8 chunks per thread). a job covering
+// several chunks hands off half of them and keeps the rest,
+// so that idle workers steal large pieces first. the body
+// receives a sub-range [first, last). without a job manager,
+// or for a single chunk, the body runs on the calling thread.
+// the split jobs live in the scratch memory of the calling
+// worker: nested loops release it in reverse order.
+// -----------------------------------------------------------
+template <class F> void ParallelChunks( int chunks, const F& chunk )
+{
+	JobManager* jm = JobManager::GetJobManager();
+	if (!jm || (chunks < 2) || (jm->GetNumThreads() < 2))
+	{
+		for( int i = 0; i < chunks; i++ ) chunk( i );
+		return;
+	}
+	struct Split : public Job
+	{
+		void Main()
+		{
+			while (last - first > 1)
+			{
+				const int mid = (first + last) / 2;
+				Split& half = *new( pool + next->fetch_add( 1 ) ) Split();
+				half.f = f, half.pool = pool, half.next = next, half.counter = counter;
+				half.first = mid, half.last = last, last = mid;
+				JobManager::GetJobManager()->AddJob2( &half, counter );
+			}
+			(*f)( first );
+		}
+		const char* GetName() { return "parallel_for"; }
+		const F* f;
+		Split* pool;
+		std::atomic<int>* next;
+		JobCounter* counter;
+		int first, last;
+	};
+	// each split adds one job, so chunks jobs suffice, including the root;
+	// splits are constructed when used, and need no destruction
+	Arena* scratch = JobManager::GetScratch();
+	const Arena::Marker mark = scratch ? scratch->Mark() : Arena::Marker();
+	Split* pool = (Split*)(scratch ? scratch->Alloc( chunks * sizeof( Split ) ) : MALLOC64( chunks * sizeof( Split ) ));
+	std::atomic<int> next( 1 );
+	JobCounter counter;
+	Split& root = *new( pool ) Split();
+	root.f = &chunk, root.pool = pool, root.next = &next, root.counter = &counter;
+	root.first = 0, root.last = chunks;
+	root.Main();
+	jm->Wait( &counter );
+	if (scratch) scratch->Rewind( mark ); else FREE64( pool );
+}
+
+inline int ParallelGrain( int count, int grain )
+{
+	if (grain > 0) return grain;
+	JobManager* jm = JobManager::GetJobManager();
+	return MAX( 1, count / (8 * (jm ? (int)jm->GetNumThreads() : 1)) );
+}
+
+template <class F> void parallel_for( int begin, int end, int grain, const F& body )
+{
+	if (end <= begin) return;
+	grain = ParallelGrain( end - begin, grain );
+	ParallelChunks( (end - begin + grain - 1) / grain, [&]( int c ) { body( begin + c * grain, MIN( end, begin + (c + 1) * grain ) ); } );
+}
+
+// body( first, last ) returns the partial result of a sub-range; partial
+// results are combined in range order, so the result does not depend on
+// scheduling, even for floating point sums
+template <class T, class F, class C> T parallel_reduce( int begin, int end, int grain, const T& identity, const F& body, const C& combine )
+{
+	if (end <= begin) return identity;
+	grain = ParallelGrain( end - begin, grain );
+	const int chunks = (end - begin + grain - 1) / grain;
+	std::vector<T> partial( chunks, identity );
+	ParallelChunks( chunks, [&]( int c ) { partial[c] = body( begin + c * grain, MIN( end, begin + (c + 1) * grain ) ); } );
+	T result = identity;
+	for( int i = 0; i < chunks; i++ ) result = combine( result, partial[i] );
+	return result;
+}
+
 }; // namespace Tmpl8
\ No newline at end of file